@@ -1,15 +1,24 @@
 /* Copyright @ 2016 Pavel Moravec */
+#include <algorithm>
 #include <chrono>
 #include <functional>
 #include <iostream>
 
 #include "zceq_misc.h"
+#include "zceq_numa.h"
+#include "zceq_runner.h"
 #include "zceq_solver.h"
 #include "args.hxx"
 
 using namespace zceq_solver;
 
-void RunBenchmark(int iterations_count, int shift, bool profiling, bool warmup);
+void RunBenchmark(int iterations_count, int shift, bool profiling, bool warmup,
+                  const PoolOptions& pool_options, int step_threads);
+void RunThreadedBenchmark(int iterations_count, int shift, int threads_count, bool warmup,
+                          const PoolOptions& pool_options, NumaRunner::SmtMode smt_mode);
+void PrintBandwidth(const RunStats& stats, int iterations_count);
+void RunPipelinedBenchmark(int iterations_count, int shift, bool warmup,
+                           const PoolOptions& pool_options);
 
 int main(const int argc, const char * const * argv) {
   std::srand(33);
@@ -37,6 +46,16 @@ int main(const int argc, const char * const * argv) {
   args::Flag random(parser, "random", "Start from random nonce.", {'r', "random"});
   args::Flag no_warmup(parser, "no-warmup", "Start from random nonce.", {'w', "no-warmup"});
 
+  args::ValueFlag<std::string> pages(parser, "pages", "Preferred memory pages: hugetlb1g, hugetlb2m (default), thp or plain.", {"pages"});
+  args::Flag prefault(parser, "prefault", "Fault in solver memory at construction (instead of warming up).", {"prefault"});
+  args::Flag lock_memory(parser, "lock-memory", "Lock solver memory in RAM (implies --prefault).", {"lock-memory"});
+  args::ValueFlag<int> threads(parser, "threads", "Run independent solvers in N threads pinned to CPUs and NUMA nodes (0 = all CPUs).", {'t', "threads"});
+  args::ValueFlag<std::string> smt(parser, "smt", "With --threads: pair threads on hyper-threading siblings with phases "
+      "independent (default), aligned or staggered.", {"smt"});
+  args::Flag pipelined(parser, "pipelined", "Generate strings of the next nonce in a second thread while reducing "
+      "the current one, compare with two independent solvers.", {"pipelined"});
+  args::ValueFlag<int> step_threads(parser, "step-threads", "Run reduction steps of one solver in N threads.", {"step-threads"});
+  args::Flag memory_plan(parser, "memory-plan", "Print memory plans (space placement) and their peak footprint, then exit.", {"memory-plan"});
   args::ValueFlag<int> iterations(parser, "iterations", "Number of different nonces to iterate (default = 50)", {'i', "iterations"});
   args::Flag profiling(parser, "profiling", "Run limited number of iterations for each supported intrcution set variant. "
       "Requires AVX2 support for proper behaviour. When specified, other options instuction set options are ignored.", {"profiling"});
@@ -60,6 +79,45 @@ int main(const int argc, const char * const * argv) {
     return 1;
   }
 
+  if (pages) {
+    const std::string kinds[] = {"hugetlb1g", "hugetlb2m", "thp", "plain"};
+    auto kind = std::find(std::begin(kinds), std::end(kinds), pages.Get());
+    if (kind == std::end(kinds)) {
+      std::cerr << "Unknown page kind: " << pages.Get() << std::endl;
+      return 1;
+    }
+    RunTimeConfig.kPagePolicy = (PagePolicy)(kind - std::begin(kinds));
+  }
+
+  auto smt_mode = NumaRunner::SmtMode::kIndependent;
+  if (smt) {
+    const std::string modes[] = {"independent", "aligned", "staggered"};
+    auto mode = std::find(std::begin(modes), std::end(modes), smt.Get());
+    if (mode == std::end(modes)) {
+      std::cerr << "Unknown SMT mode: " << smt.Get() << std::endl;
+      return 1;
+    }
+    smt_mode = (NumaRunner::SmtMode)(mode - std::begin(modes));
+  }
+
+  PoolOptions pool_options;
+  pool_options.prefault = prefault;
+  pool_options.lock = lock_memory;
+
+  if (memory_plan) {
+    auto slot_mb = Solver::GetMemorySlotSize() / 1048576.0;
+    for (auto tight : range(2)) {
+      auto slots = (u32)(tight ? Const::kMemoryForLowMemoryMode : Solver::GetMemorySlotCount());
+      auto plan = Solver::BuildMemoryPlan(tight != 0, slots);
+      printf("%s output sets%s:\n", tight ? "Tight" : "Default",
+             (tight != 0) == Const::kLowMemoryMode ? " (current)" : "");
+      plan.Dump(stdout);
+      printf("Peak footprint: %.1f MB with the current slot size (%s)\n\n", plan.GetPeakSlots() * slot_mb,
+             plan.Verify() ? "verified" : "INVALID");
+    }
+    return 0;
+  }
+
   if (random)
     std::srand((unsigned int)std::chrono::steady_clock::now().time_since_epoch().count());
 
@@ -86,7 +144,14 @@ int main(const int argc, const char * const * argv) {
     if (iterations)
       iterations_count = iterations.Get();
     int shift = std::rand();
-    RunBenchmark(iterations_count, shift, false, !no_warmup);
+    if (pipelined)
+      RunPipelinedBenchmark(iterations_count, shift, !no_warmup, pool_options);
+    else if (threads)
+      RunThreadedBenchmark(iterations_count, shift, threads.Get(), !no_warmup, pool_options,
+                           smt_mode);
+    else
+      RunBenchmark(iterations_count, shift, false, !no_warmup, pool_options,
+                   step_threads ? step_threads.Get() : 1);
   } else {
 
     if (HasAvx2Support()) {
@@ -142,7 +207,7 @@ int main(const int argc, const char * const * argv) {
                RunTimeConfig.kAllowBlake2bInBatches, scalar.SSE2, scalar.SSSE3, scalar.SSE41,
                scalar.AVX1, RunTimeConfig.kUseAsmBlake2b, scalar.AVX2, RunTimeConfig.kUseAsmBlake2b);
         printf("-----------------------------------------------------------------------\n");
-        RunBenchmark(iterations_count, shift, true, !no_warmup);
+        RunBenchmark(iterations_count, shift, true, !no_warmup, pool_options, 1);
         if (random)
           shift = std::rand();
       }
@@ -152,13 +217,18 @@ int main(const int argc, const char * const * argv) {
 }
 
 
-void RunBenchmark(int iterations_count, int shift, bool profiling, bool warmup) {
+void RunBenchmark(int iterations_count, int shift, bool profiling, bool warmup,
+                  const PoolOptions& pool_options, int step_threads) {
   // The solver needn't to copy the data when they are aligned properly.
   alignas(32) Inputs inputs;
   // Just produce some "random" block header.
   memset(inputs.data, 'Z', 140);
 
-  Solver solver;
+  ScopeTimer ct;
+  Solver solver(pool_options);
+  if (pool_options.prefault || pool_options.lock)
+    printf("Memory prefaulted in %" PRId64 " ms\n", ct.Micro() / 1000);
+  solver.SetStepThreads((u32)std::max(step_threads, 1));
   if (warmup) {
     solver.Reset(inputs);
     printf("Warming up... \n");
@@ -170,6 +240,7 @@ void RunBenchmark(int iterations_count, int shift, bool profiling, bool warmup)
   ScopeTimer gt;
   auto total_solutions = 0;
   auto total_invalid_sols = 0;
+  RunStats total_stats;
   for (auto iter : range(iterations_count)) {
     ScopeTimer t;
     inputs.SetSimpleNonce((u64)(iter + shift));
@@ -177,6 +248,7 @@ void RunBenchmark(int iterations_count, int shift, bool profiling, bool warmup)
     auto solution_count = solver.Run();
     auto solutions = solver.GetSolutions();
     total_invalid_sols += solver.GetInvalidSolutionCount();
+    total_stats.Add(solver.GetRunStats());
     assert(solutions.size() == solution_count);
     printf("%2d solutions in %" PRId64 " ms (%d inv.)\n", solution_count, t.Micro() / 1000,
            solver.GetInvalidSolutionCount());
@@ -197,7 +269,107 @@ void RunBenchmark(int iterations_count, int shift, bool profiling, bool warmup)
   }
   if (!profiling) {
     printf("*******************************\n");
+    printf("Memory pages: %s (%" PRIu64 " kB)\n", GetPagePolicyName(solver.GetPagePolicy()),
+           solver.GetPageSize() / 1024);
+    printf("Peak memory: %.1f MB (pool %.1f MB)\n", solver.GetPeakMemoryUsage() / 1048576.0,
+           Solver::GetMemoryPoolSize() / 1048576.0);
     printf("Total %d solutions in %" PRId64 " ms\n", total_solutions,
            gt.Micro() / 1000);
+    PrintBandwidth(total_stats, iterations_count);
+  }
+}
+
+void PrintBandwidth(const RunStats& stats, int iterations_count) {
+  auto print_line = [iterations_count](const char* name, const StepStats& step) {
+    printf("%-10s %8.1f %8.1f %8.2f %8.2f\n", name,
+           step.bytes_read / (1048576.0 * iterations_count),
+           step.bytes_written / (1048576.0 * iterations_count),
+           step.time_micro / (1000.0 * iterations_count),
+           step.GetBandwidth());
+  };
+  printf("Memory traffic per run:\n");
+  printf("%-10s %8s %8s %8s %8s\n", "phase", "read MB", "write MB", "ms", "GB/s");
+  print_line("generation", stats.generation);
+  for (auto i : range(Const::K_parameter)) {
+    char name[16];
+    snprintf(name, sizeof name, "step %d", i);
+    print_line(name, stats.steps[i]);
+  }
+}
+
+void RunThreadedBenchmark(int iterations_count, int shift, int threads_count, bool warmup,
+                          const PoolOptions& pool_options, NumaRunner::SmtMode smt_mode) {
+  alignas(32) Inputs inputs;
+  memset(inputs.data, 'Z', 140);
+
+  auto& topology = NumaTopology::Get();
+  NumaRunner runner((u32)std::max(threads_count, 0), pool_options, smt_mode);
+  const char* smt_names[] = {"independent", "aligned", "staggered"};
+  printf("Running %d threads on %d NUMA node(s), %d core(s)%s, phases %s\n",
+         runner.GetThreadCount(), (int)topology.nodes.size(), (int)topology.cores.size(),
+         topology.HasSmt() ? " with SMT" : "", smt_names[(int)smt_mode]);
+  if (warmup) {
+    printf("Warming up... \n");
+    fflush(stdout);
+    runner.Run(inputs, 0, runner.GetThreadCount());
+    runner.ResetReport();
+  }
+
+  ScopeTimer gt;
+  auto total_solutions = runner.Run(inputs, (u64)shift, (u32)iterations_count);
+  auto wall_micro = gt.Micro();
+
+  printf("*******************************\n");
+  for (auto& report : runner.GetReport()) {
+    if (report.threads == 0)
+      continue;
+    printf("node %d: %u threads, %" PRIu64 " iters, %" PRIu64 " sols, %.5G s/iter per thread,"
+           " %.4G sol/s\n", report.node, report.threads, report.iterations,
+           report.solutions,
+           report.iterations ? double(report.busy_micro) / (report.iterations * 1000000ll) : 0.0,
+           (report.solutions * 1000000ll) / double(wall_micro));
+  }
+  printf("Total %" PRIu64 " solutions in %" PRId64 " ms, %.4G sol/s\n", total_solutions,
+         wall_micro / 1000, (total_solutions * 1000000ll) / double(wall_micro));
+}
+
+void RunPipelinedBenchmark(int iterations_count, int shift, bool warmup,
+                           const PoolOptions& pool_options) {
+  alignas(32) Inputs inputs;
+  memset(inputs.data, 'Z', 140);
+
+  PipelinedRunner pipeline(pool_options);
+  if (warmup) {
+    printf("Warming up... \n");
+    fflush(stdout);
+    pipeline.Run(inputs, 0, 2);
+    pipeline.ResetReport();
   }
+  ScopeTimer pt;
+  auto pipeline_solutions = pipeline.Run(inputs, (u64)shift, (u32)iterations_count);
+  auto pipeline_micro = pt.Micro();
+  auto& report = pipeline.GetReport();
+
+  // The same work by two independent solvers (two threads as well).
+  NumaRunner runner(2, pool_options);
+  if (warmup) {
+    runner.Run(inputs, 0, runner.GetThreadCount());
+    runner.ResetReport();
+  }
+  ScopeTimer it;
+  auto independent_solutions = runner.Run(inputs, (u64)shift, (u32)iterations_count);
+  auto independent_micro = it.Micro();
+
+  printf("*******************************\n");
+  printf("Pipelined: %" PRIu64 " sols in %" PRId64 " ms, %.4G sol/s, %.4G sol/s per thread"
+         " (generation busy %.0f%%, reduction busy %.0f%%)\n",
+         pipeline_solutions, pipeline_micro / 1000,
+         (pipeline_solutions * 1000000ll) / double(pipeline_micro),
+         (pipeline_solutions * 1000000ll) / double(pipeline_micro) / 2,
+         100.0 * report.generation_micro / pipeline_micro,
+         100.0 * report.reduction_micro / pipeline_micro);
+  printf("Independent: %" PRIu64 " sols in %" PRId64 " ms, %.4G sol/s, %.4G sol/s per thread\n",
+         independent_solutions, independent_micro / 1000,
+         (independent_solutions * 1000000ll) / double(independent_micro),
+         (independent_solutions * 1000000ll) / double(independent_micro) / 2);
 }
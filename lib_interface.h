@@ -18,22 +18,122 @@ typedef struct HeaderAndNonce {
 
 typedef struct ZcEquihashSolverT ZcEquihashSolver;
 
+typedef struct ZcEquihashVerifierT ZcEquihashVerifier;
+
 ZcEquihashSolver* CreateSolver(void);
 
+// Creates a solver with its memory mapped immediately. With `prefault`,
+// all pages are faulted in, so the first solving is not slowed down.
+// With `lock_memory`, the pages are also locked in RAM (mlock); failure
+// to lock (e.g. low RLIMIT_MEMLOCK) is reported but not fatal.
+ZcEquihashSolver* CreateSolverWithOptions(bool prefault, bool lock_memory);
+
 void DestroySolver(ZcEquihashSolver* solver);
 
+// Selects preferred memory pages for solvers (and the shared arena)
+// created afterwards: 0 = hugetlb 1GB, 1 = hugetlb 2MB (default),
+// 2 = transparent huge pages, 3 = plain 4kB pages. If the pages are not
+// available, the next kind is used. Returns false for unknown values.
+bool SetPagePolicy(int policy);
+
+// Returns effective size of memory pages used by the solver, 0 when its
+// memory is not mapped yet (before the first solving).
+long long GetSolverPageSize(ZcEquihashSolver* solver);
+
+// Returns the most memory used by one solving of the solver so far (its
+// whole footprint, in bytes).
+long long GetSolverPeakMemory(ZcEquihashSolver* solver);
+
+// Reserves process-wide memory for `solver_count` solvers at once. Solvers
+// take their memory pool from it instead of mapping own memory, a pool is
+// placed on the NUMA node of the thread which runs the solver first. With
+// `prefault` set, the pages are touched before the first use. It can be
+// called only once. Returns false on failure.
+bool ReserveSharedArena(int solver_count, bool prefault);
+
+// Solutions are packed straight into `solutions` as they are found, when
+// there are more than `max_solutions`, the first ones are kept in order
+// of finding. With
+// `solutions` NULL, they are written to the ring of the solver (see
+// `SetSolutionRing`). Returns number of solutions found.
 int FindSolutions(ZcEquihashSolver* solver, HeaderAndNonce* inputs,
                   Solution solutions[], int max_solutions);
 
+// Registers caller's memory for `capacity` solutions. Solutions found by
+// `FindSolutions` without own array and by `FindSolutionsWithCallback` are
+// written into slot `n % capacity`, n being the number of solutions
+// written to the ring so far (`GetSolutionRingCount`). No copies are made
+// on the way. `capacity` 0 unregisters the ring.
+bool SetSolutionRing(ZcEquihashSolver* solver, Solution ring[], int capacity);
+
+long long GetSolutionRingCount(ZcEquihashSolver* solver);
+
+// Solves nonces `nonce_start` .. `nonce_start + nonce_count - 1` of each
+// of `header_count` headers in one call (the nonce is written over bytes
+// 132..139 of a header, little endian, like by `SubmitJob`). Up to
+// `max_solutions` solutions are written to `solutions` in the order they
+// are found, `origins[i]` (if not NULL) receives `header_index *
+// nonce_count + nonce_offset` of the input which produced `solutions[i]`.
+// Returns number of solutions found, even those which didn't fit into
+// `solutions`, -1 on errors.
+int FindSolutionsBatch(ZcEquihashSolver* solver, HeaderAndNonce headers[],
+                       int header_count, unsigned long long nonce_start,
+                       int nonce_count, Solution solutions[],
+                       long long origins[], int max_solutions);
+
+// Results of `FindSolutionsMany`, all arrays are allocated by the caller.
+// Solutions of input i are `solutions[first[i]]` ..
+// `solutions[first[i] + count[i] - 1]`.
+typedef struct SolutionTable {
+  Solution* solutions;
+  int capacity;
+  // `n_inputs` entries each.
+  int* first;
+  int* count;
+  // Filled in: solutions which didn't fit into `solutions`.
+  int dropped;
+} SolutionTable;
+
+// Solves `n_inputs` inputs (each with its own header and nonce) one after
+// another on the same solver memory. Solutions of an input are stored in
+// order of finding into the space left by the previous inputs; once
+// `capacity` is used up, the rest of the input's solutions (and all
+// solutions of later inputs) are dropped and counted in `dropped`, so each
+// input keeps its first solutions. Returns number of solutions found
+// (including dropped ones), -1 on errors.
+int FindSolutionsMany(ZcEquihashSolver* solver, HeaderAndNonce* inputs,
+                      int n_inputs, SolutionTable* out);
+
+// Calls `on_solution` for each solution as soon as it is found. When the
+// callback returns true, no more solutions are needed and solving stops.
+// Returns number of solutions passed to the callback.
+int FindSolutionsWithCallback(ZcEquihashSolver* solver, HeaderAndNonce* inputs,
+                              bool (*on_solution)(void*, const Solution*),
+                              void* user_data);
+
 int ValidateSolution(ZcEquihashSolver* solver, HeaderAndNonce* inputs, Solution* solutions);
 
+// Lightweight instance for solution validation only. It doesn't allocate
+// the solver's memory pool.
+ZcEquihashVerifier* CreateVerifier(void);
+
+void DestroyVerifier(ZcEquihashVerifier* verifier);
+
+int VerifySolution(ZcEquihashVerifier* verifier, HeaderAndNonce* inputs, Solution* solution);
+
 void RunBenchmark(long long nonce_start, int iterations);
 
 bool ExpandedToMinimal(Solution* minimal, ExpandedSolution* expanded);
 
 bool MinimalToExpanded(ExpandedSolution* expanded, Solution* minimal);
 
-// Officially requested interface for solver challenge.
+// Officially requested interface for solver challenge. With `numThreads`
+// <= 1, it solves just the given input on a solver cached for the calling
+// thread (see `ReleaseSolverFunctionCache`). With more threads, a persistent
+// pool of `numThreads` solvers sweeps nonces starting with the given one
+// (the last 8 bytes of the input are incremented) until `validBlock`
+// returns true or `cancelled` does. `cancelled` is polled before each nonce
+// and between reduction steps. Returns number of solutions.
 int SolverFunction(const unsigned char* input,
                    bool (*validBlock)(void*, const unsigned char*),
                    void* validBlockData,
@@ -42,6 +142,48 @@ int SolverFunction(const unsigned char* input,
                    int numThreads,
                    int n, int k);
 
+typedef struct ZcEquihashJobQueueT ZcEquihashJobQueue;
+
+// Asynchronous solving on a pool of `thread_count` solver threads (0 = one
+// per CPU). Jobs submitted to the queue are processed in order, all
+// threads work on the first one.
+ZcEquihashJobQueue* CreateJobQueue(int thread_count);
+
+// Cancels all jobs (their `on_done` are called) and stops the threads.
+void DestroyJobQueue(ZcEquihashJobQueue* queue);
+
+// Queues solving of nonces `nonce_start` .. `nonce_start + nonce_count - 1`
+// of `header` (`nonce_count` == 0 means no limit). A nonce is written over
+// the last 8 bytes of the header (bytes 132..139, little endian). Returns
+// at once with a job id (> 0), -1 on invalid arguments.
+// `on_solution` is called for each solution as soon as it is found, with
+// the input it belongs to; calls are serialized per job and returning true
+// ends the job. `on_done` (can be NULL) is called once when the job ends,
+// with the number of solutions. Both are called from solver threads (or
+// from `CancelJob`), `on_done` even before `SubmitJob` returns.
+long long SubmitJob(ZcEquihashJobQueue* queue, HeaderAndNonce* header,
+                    unsigned long long nonce_start, unsigned long long nonce_count,
+                    bool (*on_solution)(void* user_data, const HeaderAndNonce* input,
+                                        const Solution* solution),
+                    void (*on_done)(void* user_data, long long job, long long solutions),
+                    void* user_data);
+
+// Ends the job (e.g. stale work after a new block template). A job not
+// started yet is dropped at once, threads working on it stop at the end of
+// their current reduction step, a few tens of milliseconds (the string
+// generation of a nonce, which is not interrupted, takes longer). `on_done`
+// follows when the last thread has left the job. Returns false for unknown
+// or ended jobs.
+bool CancelJob(ZcEquihashJobQueue* queue, long long job);
+
+// When called from `validBlock` of `SolverFunction`, returns the input
+// (140 bytes, nonce included) of the passed solution, NULL otherwise.
+const unsigned char* GetSolverFunctionHeader(void);
+
+// Destroys the solver cached by `SolverFunction` for the calling thread
+// (it is destroyed at the thread exit otherwise).
+void ReleaseSolverFunctionCache(void);
+
 }
 
 #endif  // ZCEQ_SOLVER_H_LIB_INTERFACE_H_
@@ -1,8 +1,11 @@
 /* Copyright @ 2016 Pavel Moravec */
 #include <chrono>
 #include <functional>
+#include <memory>
+#include <mutex>
 
 #include "zceq_misc.h"
+#include "zceq_runner.h"
 #include "zceq_solver.h"
 #include "lib_interface.h"
 
@@ -13,10 +16,30 @@ using namespace zceq_solver;
 
 extern "C" {
 
-struct ZcEquihashSolverT {
+struct ZcEquihashSolverT : AlignedNew {
+  ZcEquihashSolverT() = default;
+  explicit ZcEquihashSolverT(const PoolOptions& options) : solver(options) {}
+
   Solver solver;
   // Temporary variable for checking solutions withou memory allocation.
   std::vector<u32> temp_solution;
+  // See `SetSolutionRing`.
+  Solution* ring = nullptr;
+  u32 ring_capacity = 0;
+};
+
+
+struct ZcEquihashJobQueueT {
+  explicit ZcEquihashJobQueueT(u32 thread_count) : pool(thread_count) {}
+
+  SolverPool pool;
+};
+
+
+struct ZcEquihashVerifierT : AlignedNew {
+  Verifier verifier;
+  // Temporary variable for checking solutions withou memory allocation.
+  std::vector<u32> temp_solution;
 };
 
 
@@ -24,29 +47,173 @@ ZcEquihashSolver* CreateSolver(void) {
   return new ZcEquihashSolver();
 }
 
+ZcEquihashSolver* CreateSolverWithOptions(bool prefault, bool lock_memory) {
+  PoolOptions options;
+  options.prefault = prefault;
+  options.lock = lock_memory;
+  return new ZcEquihashSolver(options);
+}
+
 void DestroySolver(ZcEquihashSolver* solver) {
   if (solver != nullptr)
-    delete (Solver*)(void*)solver;
+    delete solver;
+}
+
+bool SetPagePolicy(int policy) {
+  if (policy < (int)PagePolicy::kHugeTlb1G || policy > (int)PagePolicy::kPlain)
+    return false;
+  RunTimeConfig.kPagePolicy = (PagePolicy)policy;
+  return true;
+}
+
+long long GetSolverPageSize(ZcEquihashSolver* solver) {
+  if (!solver)
+    return -1;
+  return (long long)solver->solver.GetPageSize();
+}
+
+long long GetSolverPeakMemory(ZcEquihashSolver* solver) {
+  if (!solver)
+    return -1;
+  return (long long)solver->solver.GetPeakMemoryUsage();
+}
+
+bool ReserveSharedArena(int solver_count, bool prefault) {
+  if (solver_count <= 0)
+    return false;
+  return SharedArena::Get().Reserve(Solver::GetMemoryPoolSize(),
+                                    solver_count, prefault);
 }
 
+static_assert(sizeof(Solution) == Const::kMinimalSolutionBytes, "");
+
 int FindSolutions(ZcEquihashSolver* solver, HeaderAndNonce* inputs,
                   Solution solutions[], int max_solutions) {
-  if (!solver || !inputs || !solutions || !max_solutions)
+  if (!solver || !inputs || (solutions && max_solutions <= 0))
     return -1;
   auto& s = solver->solver;
 
+  // The solver writes solutions to the caller's array, the ring continues
+  // where it was afterwards.
+  auto ring_count = s.GetSolutionOutputCount();
+  if (solutions)
+    s.SetSolutionOutput((u8*)solutions, (u32)max_solutions, false);
   s.Reset((const u8*)inputs->data, sizeof Inputs::data);
   auto solution_count = s.Run();
-  auto sol_vector = s.GetSolutions();
-  if (solution_count > 0) {
-    max_solutions = std::min(max_solutions, solution_count);
-    for (auto sol : range(max_solutions)) {
-      GetMinimalFromIndices(sol_vector[sol]->data(),
-                            sol_vector[sol]->size(),
-                            (u8*)solutions[sol].data,
-                            sizeof solutions[sol].data);
+  if (solutions)
+    s.SetSolutionOutput((u8*)solver->ring, solver->ring_capacity, true,
+                        ring_count);
+  return solution_count;
+}
+
+int FindSolutionsMany(ZcEquihashSolver* solver, HeaderAndNonce* inputs,
+                      int n_inputs, SolutionTable* out) {
+  if (!solver || !inputs || n_inputs < 0 || !out || !out->first || !out->count ||
+      out->capacity < 0 || (out->capacity && !out->solutions))
+    return -1;
+  auto& s = solver->solver;
+
+  auto ring_count = s.GetSolutionOutputCount();
+  int used = 0;
+  int found = 0;
+  out->dropped = 0;
+  for (auto input : range(n_inputs)) {
+    // Solutions of the input are packed right behind the previous ones,
+    // those which don't fit into the rest are dropped.
+    s.SetSolutionOutput((u8*)(out->solutions + used), (u32)(out->capacity - used),
+                        false);
+    s.Reset((const u8*)inputs[input].data, sizeof Inputs::data);
+    auto solution_count = s.Run();
+    if (solution_count < 0) {
+      found = -1;
+      break;
     }
+    auto stored = std::min(solution_count, out->capacity - used);
+    out->first[input] = used;
+    out->count[input] = stored;
+    out->dropped += solution_count - stored;
+    used += stored;
+    found += solution_count;
   }
+  s.SetSolutionOutput((u8*)solver->ring, solver->ring_capacity, true,
+                        ring_count);
+  return found;
+}
+
+bool SetSolutionRing(ZcEquihashSolver* solver, Solution ring[], int capacity) {
+  if (!solver || capacity < 0 || (capacity && !ring))
+    return false;
+  solver->ring = capacity ? ring : nullptr;
+  solver->ring_capacity = (u32)capacity;
+  solver->solver.SetSolutionOutput((u8*)solver->ring, solver->ring_capacity, true);
+  return true;
+}
+
+long long GetSolutionRingCount(ZcEquihashSolver* solver) {
+  if (!solver)
+    return -1;
+  return (long long)solver->solver.GetSolutionOutputCount();
+}
+
+int FindSolutionsBatch(ZcEquihashSolver* solver, HeaderAndNonce headers[],
+                       int header_count, unsigned long long nonce_start,
+                       int nonce_count, Solution solutions[],
+                       long long origins[], int max_solutions) {
+  if (!solver || !headers || header_count < 0 || nonce_count < 0 ||
+      max_solutions < 0 || (max_solutions && !solutions))
+    return -1;
+  auto& s = solver->solver;
+
+  // Solutions are packed straight into the caller's array behind the
+  // previous ones, the ring continues where it was afterwards.
+  auto ring_count = s.GetSolutionOutputCount();
+  alignas(32) Inputs inputs;
+  int found = 0;
+  for (auto header : range(header_count)) {
+    memcpy(inputs.data, headers[header].data, sizeof headers[header].data);
+    for (auto offset : range(nonce_count)) {
+      auto stored = std::min(found, max_solutions);
+      s.SetSolutionOutput((u8*)(solutions + stored),
+                          (u32)(max_solutions - stored), false);
+      inputs.SetSimpleNonce(nonce_start + offset);
+      s.Reset(inputs);
+      auto solution_count = s.Run();
+      if (solution_count < 0) {
+        found = -1;
+        break;
+      }
+      if (origins) {
+        auto origin = (long long)header * nonce_count + offset;
+        for (auto sol : range(stored, std::min(stored + solution_count,
+                                               max_solutions)))
+          origins[sol] = origin;
+      }
+      found += solution_count;
+    }
+    if (found < 0)
+      break;
+  }
+  s.SetSolutionOutput((u8*)solver->ring, solver->ring_capacity, true,
+                      ring_count);
+  return found;
+}
+
+int FindSolutionsWithCallback(ZcEquihashSolver* solver, HeaderAndNonce* inputs,
+                              bool (*on_solution)(void*, const Solution*),
+                              void* user_data) {
+  if (!solver || !inputs || !on_solution)
+    return -1;
+  auto& s = solver->solver;
+
+  Solution minimal;
+  s.SetSolutionCallback([&](const std::vector<u32>& solution) {
+    GetMinimalFromIndices(solution.data(), solution.size(),
+                          (u8*)minimal.data, sizeof minimal.data);
+    return on_solution(user_data, &minimal);
+  });
+  s.Reset((const u8*)inputs->data, sizeof Inputs::data);
+  auto solution_count = s.Run();
+  s.SetSolutionCallback(nullptr);
   return solution_count;
 }
 
@@ -65,6 +232,30 @@ int ValidateSolution(ZcEquihashSolver* solver, HeaderAndNonce* inputs, Solution*
   return 0;
 }
 
+ZcEquihashVerifier* CreateVerifier(void) {
+  return new ZcEquihashVerifier();
+}
+
+void DestroyVerifier(ZcEquihashVerifier* verifier) {
+  if (verifier != nullptr)
+    delete verifier;
+}
+
+int VerifySolution(ZcEquihashVerifier* verifier, HeaderAndNonce* inputs, Solution* solution) {
+  if (!verifier || !inputs || !solution)
+    return -1;
+  auto& v = verifier->verifier;
+
+  v.Reset((const u8*)inputs->data, sizeof Inputs::data);
+  verifier->temp_solution.resize(Const::kSolutionSize);
+  GetIndicesFromMinimal((const u8*)solution->data, sizeof solution->data,
+                        verifier->temp_solution.data(), Const::kSolutionSize);
+
+  if (v.ValidateSolution(verifier->temp_solution))
+    return 1;
+  return 0;
+}
+
 bool ExpandedToMinimal(Solution* minimal, ExpandedSolution* expanded) {
   return GetMinimalFromIndices(expanded->data, sizeof expanded->data / sizeof *expanded->data,
                                (u8*)minimal->data, sizeof minimal->data);
@@ -75,6 +266,75 @@ bool MinimalToExpanded(ExpandedSolution* expanded, Solution* minimal) {
                                expanded->data, sizeof expanded->data / sizeof *expanded->data);
 }
 
+ZcEquihashJobQueue* CreateJobQueue(int thread_count) {
+  return new ZcEquihashJobQueue((u32)std::max(thread_count, 0));
+}
+
+void DestroyJobQueue(ZcEquihashJobQueue* queue) {
+  if (queue != nullptr)
+    delete queue;
+}
+
+long long SubmitJob(ZcEquihashJobQueue* queue, HeaderAndNonce* header,
+                    unsigned long long nonce_start, unsigned long long nonce_count,
+                    bool (*on_solution)(void*, const HeaderAndNonce*, const Solution*),
+                    void (*on_done)(void*, long long, long long),
+                    void* user_data) {
+  if (!queue || !header || !on_solution)
+    return -1;
+  alignas(32) Inputs inputs;
+  memcpy(inputs.data, header->data, sizeof inputs.data);
+  auto job = queue->pool.Submit(
+      inputs, nonce_start, nonce_count,
+      [on_solution, user_data](const Inputs& solution_inputs,
+                               const std::vector<u32>& solution) {
+        Solution minimal;
+        GetMinimalFromIndices(solution.data(), solution.size(),
+                              (u8*)minimal.data, sizeof minimal.data);
+        return on_solution(user_data, (const HeaderAndNonce*)solution_inputs.data,
+                           &minimal);
+      },
+      [on_done, user_data](u64 job_id, u64 solutions) {
+        if (on_done)
+          on_done(user_data, (long long)job_id, (long long)solutions);
+      });
+  return (long long)job;
+}
+
+bool CancelJob(ZcEquihashJobQueue* queue, long long job) {
+  if (!queue || job <= 0)
+    return false;
+  return queue->pool.Cancel((u64)job);
+}
+
+// Pool used by `SolverFunction`, replaced when a different number of
+// threads is requested. Calls still running keep the old pool alive.
+static std::mutex solver_pool_mutex;
+static std::shared_ptr<SolverPool> solver_pool;
+// Input of the solution being passed to `validBlock` (in its thread).
+static thread_local const u8* solver_function_input = nullptr;
+
+static std::shared_ptr<SolverPool> GetSolverPool(u32 thread_count) {
+  std::lock_guard<std::mutex> lock(solver_pool_mutex);
+  if (!solver_pool || solver_pool->GetThreadCount() != thread_count)
+    solver_pool = std::make_shared<SolverPool>(thread_count);
+  return solver_pool;
+}
+
+// A solver per calling thread for single threaded `SolverFunction`, kept
+// warm (memory pool, blake backend) for the next calls. It is allocated
+// by `AlignedNew`, which must cover the alignment of the blake2b state.
+static_assert(alignof(Solver) <= AlignedNew::kAlignment,
+              "Solver is aligned more than AlignedNew provides");
+static std::unique_ptr<Solver>& GetThreadSolver() {
+  static thread_local std::unique_ptr<Solver> thread_solver;
+  return thread_solver;
+}
+
+const unsigned char* GetSolverFunctionHeader(void) {
+  return solver_function_input;
+}
+
 int SolverFunction(const unsigned char* input,
                    bool (*validBlock)(void*, const unsigned char*),
                    void* validBlockData,
@@ -85,21 +345,57 @@ int SolverFunction(const unsigned char* input,
   if (n != 200 || k != 9)
     return -1;
 
-  // Make the instance on stack :/
-  Solver s;
+  if (numThreads > 1) {
+    alignas(32) Inputs inputs;
+    memcpy(inputs.data, input, sizeof inputs.data);
+    auto pool = GetSolverPool((u32)numThreads);
+    // The sweep never runs out of nonces, so it always gets a cancel
+    // callback.
+    auto solution_count = pool->Sweep(
+        inputs, inputs.s.nonce, 0,
+        [&](const Inputs& solution_inputs, const std::vector<u32>& solution) {
+          u8 minimal[1344];
+          GetMinimalFromIndices(solution.data(), solution.size(),
+                                minimal, sizeof minimal);
+          solver_function_input = solution_inputs.data;
+          auto result = validBlock(validBlockData, minimal);
+          solver_function_input = nullptr;
+          return result;
+        },
+        [&]() {
+          return cancelled && cancelled(cancelledData);
+        });
+    return (int)solution_count;
+  }
+
+  auto& thread_solver = GetThreadSolver();
+  if (!thread_solver)
+    thread_solver.reset(new Solver());
+  auto& s = *thread_solver;
+  // Submit each solution immediately, the rest is not needed once a valid
+  // block is found.
+  u8 minimal[1344];
+  s.SetSolutionCallback([&](const std::vector<u32>& solution) {
+    GetMinimalFromIndices(solution.data(), solution.size(),
+                          minimal, sizeof minimal);
+    solver_function_input = input;
+    auto result = validBlock(validBlockData, minimal);
+    solver_function_input = nullptr;
+    return result;
+  });
+  if (cancelled) {
+    s.SetStopCallback([&]() {
+      return cancelled(cancelledData);
+    });
+  }
   s.Reset((const u8*)input, 140);
   auto solution_count = s.Run();
-  auto sol_vector = s.GetSolutions();
-  if (solution_count > 0) {
-    u8 solution[1344];
-    for (auto sol : range(solution_count)) {
-      GetMinimalFromIndices(sol_vector[sol]->data(),
-                            sol_vector[sol]->size(),
-                            solution,
-                            sizeof solution);
-      validBlock(validBlockData, solution);
-    }
-  }
+  s.SetSolutionCallback(nullptr);
+  s.SetStopCallback(nullptr);
   return solution_count;
 }
+
+void ReleaseSolverFunctionCache(void) {
+  GetThreadSolver().reset();
+}
 }
@@ -1,6 +1,8 @@
 from cffi import FFI
 import pkg_resources
 import platform
+import threading
+import time
 import pyzceqsolver
 
 ffi = None
@@ -23,13 +25,55 @@ typedef struct ZcEquihashSolverT ZcEquihashSolver;
 
 ZcEquihashSolver* CreateSolver(void);
 
+ZcEquihashSolver* CreateSolverWithOptions(bool prefault, bool lock_memory);
+
 void DestroySolver(ZcEquihashSolver* solver);
 
+bool SetPagePolicy(int policy);
+
+long long GetSolverPageSize(ZcEquihashSolver* solver);
+
+long long GetSolverPeakMemory(ZcEquihashSolver* solver);
+
+bool ReserveSharedArena(int solver_count, bool prefault);
+
 int FindSolutions(ZcEquihashSolver* solver, HeaderAndNonce* inputs,
                   Solution solutions[], int max_solutions);
 
+bool SetSolutionRing(ZcEquihashSolver* solver, Solution ring[], int capacity);
+
+long long GetSolutionRingCount(ZcEquihashSolver* solver);
+
+int FindSolutionsBatch(ZcEquihashSolver* solver, HeaderAndNonce headers[],
+                       int header_count, unsigned long long nonce_start,
+                       int nonce_count, Solution solutions[],
+                       long long origins[], int max_solutions);
+
 int ValidateSolution(ZcEquihashSolver* solver, HeaderAndNonce* inputs, Solution* solutions);
 
+typedef struct ZcEquihashJobQueueT ZcEquihashJobQueue;
+
+ZcEquihashJobQueue* CreateJobQueue(int thread_count);
+
+void DestroyJobQueue(ZcEquihashJobQueue* queue);
+
+long long SubmitJob(ZcEquihashJobQueue* queue, HeaderAndNonce* header,
+                    unsigned long long nonce_start, unsigned long long nonce_count,
+                    bool (*on_solution)(void* user_data, const HeaderAndNonce* input,
+                                        const Solution* solution),
+                    void (*on_done)(void* user_data, long long job, long long solutions),
+                    void* user_data);
+
+bool CancelJob(ZcEquihashJobQueue* queue, long long job);
+
+typedef struct ZcEquihashVerifierT ZcEquihashVerifier;
+
+ZcEquihashVerifier* CreateVerifier(void);
+
+void DestroyVerifier(ZcEquihashVerifier* verifier);
+
+int VerifySolution(ZcEquihashVerifier* verifier, HeaderAndNonce* inputs, Solution* solution);
+
 bool ExpandedToMinimal(Solution* minimal, ExpandedSolution* expanded);
 
 bool MinimalToExpanded(ExpandedSolution* expanded, Solution* minimal);
@@ -56,12 +100,45 @@ def load_library():
     log.info('Loaded shared library: {0}'.format(library_filename))
 
 
+# Memory page kinds accepted by `set_page_policy`.
+PAGES_HUGETLB_1G = 0
+PAGES_HUGETLB_2M = 1
+PAGES_TRANSPARENT_HUGE = 2
+PAGES_PLAIN = 3
+
+
+def set_page_policy(policy):
+    """Selects preferred memory pages for solvers created afterwards. When
+    the pages are not available, the next (smaller) kind is used.
+    """
+    if (library is None):
+        load_library()
+    return library.SetPagePolicy(policy)
+
+
+def reserve_shared_arena(solver_count, prefault=False):
+    """Reserves memory for `solver_count` solvers in one mapping. Solvers
+    created afterwards take their memory from it. Call it once, before
+    creating solvers.
+    """
+    if (library is None):
+        load_library()
+    return library.ReserveSharedArena(solver_count, prefault)
+
+
 class Solver:
-    def __init__(self, verbose=True):
+    def __init__(self, verbose=True, prefault=False, lock_memory=False):
+        """With `prefault`, the solver memory is faulted in right away, so the
+        first solving is not slowed down. `lock_memory` also locks it in RAM.
+        """
         self.solver_ = self.header_ = self.solutions_ = self.solution_to_check_ = None
+        self.ring_ = None
         self._ensure_library()
         assert library and ffi
-        self.solver_ = library.CreateSolver()
+        if prefault or lock_memory:
+            self.solver_ = library.CreateSolverWithOptions(prefault, lock_memory)
+        else:
+            self.solver_ = library.CreateSolver()
         self.header_ = ffi.new("HeaderAndNonce*")
         self.solutions_ = ffi.new("Solution[16]")
         self.minimal_tmp_ = ffi.new("Solution*")
@@ -73,6 +150,7 @@ class Solver:
         self.solver_ = None
         # cffi's cdata are collected automatically
         self.header_ = self.solutions_ = self.minimal_tmp_ = self.expanded_tmp_ = None
+        self.ring_ = None
 
     def _ensure_library(self):
         # Try to load library from standard
@@ -80,10 +158,76 @@ class Solver:
             load_library()
 
     def find_solutions(self, block_header):
+        """Returns number of solutions found. They are available by
+        `get_solution` or, if a ring is registered, in the ring.
+        """
         assert len(block_header) == 140
         self.header_.data = block_header
+        if self.ring_ is not None:
+            return library.FindSolutions(self.solver_, self.header_, ffi.NULL, 0)
         return library.FindSolutions(self.solver_, self.header_, self.solutions_, 16);
 
+    def set_solution_ring(self, buffer):
+        """Registers a writable buffer (bytearray, numpy uint8 array, ...) of
+        n * 1344 bytes. `find_solutions` then packs solutions straight into
+        it, the k-th solution since the registration into slot k % n (see
+        `solution_ring_count`), so nothing is copied on the way. None
+        unregisters the buffer.
+        """
+        if buffer is None:
+            library.SetSolutionRing(self.solver_, ffi.NULL, 0)
+            self.ring_ = None
+            return
+        ring = ffi.from_buffer("Solution[]", buffer, require_writable=True)
+        assert len(ring) > 0
+        library.SetSolutionRing(self.solver_, ring, len(ring))
+        # The library writes into the buffer, keep it alive.
+        self.ring_ = ring
+
+    def solution_ring_count(self):
+        """Number of solutions written to the ring since its registration."""
+        return library.GetSolutionRingCount(self.solver_)
+
+    def find_solutions_batch(self, headers, nonce_start, count, out=None):
+        """Solves nonces `nonce_start` .. `nonce_start + count - 1` of each of
+        `headers` (140 bytes each) in one library call, the GIL is released
+        meanwhile. A nonce replaces the last 8 bytes of a header (little
+        endian). Solutions (1344 bytes each) are written one after another
+        into `out`, a writable buffer (bytearray, numpy uint8 array, ...).
+        When it is not given, a bytearray for 4 solutions per input is
+        allocated. Returns `(out, origins)` where `origins[i]` is a pair
+        (header index, nonce) of the i-th solution in `out`.
+        """
+        headers = list(headers)
+        if out is None:
+            out = bytearray(max(4 * len(headers) * count, 1) * 1344)
+        assert len(out) > 0 and len(out) % 1344 == 0
+        c_headers = ffi.new("HeaderAndNonce[]", len(headers))
+        for i, header in enumerate(headers):
+            assert len(header) == 140
+            c_headers[i].data = header
+        solutions = ffi.from_buffer("Solution[]", out, require_writable=True)
+        max_solutions = len(solutions)
+        origins = ffi.new("long long[]", max(max_solutions, 1))
+        found = library.FindSolutionsBatch(self.solver_, c_headers, len(headers),
+                                           nonce_start, count, solutions,
+                                           origins, max_solutions)
+        assert found >= 0
+        if found > max_solutions:
+            log.warning('{0} solutions did not fit into the output buffer'.format(
+                found - max_solutions))
+        written = min(found, max_solutions)
+        return out, [(origins[i] // count, nonce_start + origins[i] % count)
+                     for i in range(written)]
+
+    def get_page_size(self):
+        """Effective memory page size, 0 before the first solving."""
+        return library.GetSolverPageSize(self.solver_)
+
+    def get_peak_memory(self):
+        """The most memory used by one solving so far (bytes)."""
+        return library.GetSolverPeakMemory(self.solver_)
+
     def get_solution(self, num):
         assert(num >= 0 and num < 16)
         return bytes(ffi.buffer(self.solutions_[num].data))
@@ -122,4 +266,162 @@ class Solver:
         return result
 
 
-__all__ = ['Solver', 'load_library']
+class SolverJob:
+    """Future of a job submitted to `SolverPool`. Iterating over it yields
+    pairs (header, solution) as soon as they are found, header being the
+    input with the nonce which produced the solution.
+    """
+    def __init__(self, pool, max_solutions):
+        self.pool_ = pool
+        self.id_ = None
+        self.max_solutions_ = max_solutions
+        self.solutions_ = []
+        self.done_ = False
+        self.condition_ = threading.Condition()
+        # Keeps the job reachable from the library callbacks.
+        self.handle_ = ffi.new_handle(self)
+
+    def _add_solution(self, header, solution):
+        with self.condition_:
+            self.solutions_.append((header, solution))
+            self.condition_.notify_all()
+            return (self.max_solutions_ is not None and
+                    len(self.solutions_) >= self.max_solutions_)
+
+    def _finish(self):
+        with self.condition_:
+            self.done_ = True
+            self.condition_.notify_all()
+
+    def cancel(self):
+        """Stops the job, threads working on it finish their current nonce.
+        Returns False when the job has already ended.
+        """
+        return library.CancelJob(self.pool_.queue_, self.id_)
+
+    def done(self):
+        with self.condition_:
+            return self.done_
+
+    def wait(self, timeout=None):
+        """Waits for the end of the job, returns False on timeout."""
+        deadline = None if timeout is None else time.time() + timeout
+        with self.condition_:
+            while not self.done_:
+                remaining = None if deadline is None else deadline - time.time()
+                if remaining is not None and remaining <= 0:
+                    break
+                self.condition_.wait(remaining)
+            return self.done_
+
+    def result(self):
+        """Waits for the end of the job, returns all its solutions."""
+        self.wait()
+        return list(self.solutions_)
+
+    def __iter__(self):
+        index = 0
+        while True:
+            with self.condition_:
+                while index >= len(self.solutions_) and not self.done_:
+                    self.condition_.wait()
+                if index >= len(self.solutions_):
+                    return
+                item = self.solutions_[index]
+            index += 1
+            yield item
+
+
+class SolverPool:
+    """Native pool of `threads` solver threads (0 = one per CPU) in this
+    process. Submitted jobs are processed in order, all threads sweep
+    nonces of the first one. Callbacks come from the native threads, the
+    GIL is held only while a solution is being handed over.
+    """
+    def __init__(self, threads=0):
+        self.queue_ = None
+        if (library is None):
+            load_library()
+        assert library and ffi
+        self.jobs_ = set()
+        self.on_solution_ = ffi.callback(
+            "bool(void*, const HeaderAndNonce*, const Solution*)",
+            self._on_solution)
+        self.on_done_ = ffi.callback("void(void*, long long, long long)",
+                                     self._on_done)
+        self.header_ = ffi.new("HeaderAndNonce*")
+        self.queue_ = library.CreateJobQueue(threads)
+
+    def __del__(self):
+        self.close()
+
+    def close(self):
+        """Cancels all jobs and stops the threads."""
+        if self.queue_ is not None:
+            library.DestroyJobQueue(self.queue_)
+            self.queue_ = None
+
+    @staticmethod
+    def _on_solution(user_data, inputs, solution):
+        job = ffi.from_handle(user_data)
+        return job._add_solution(bytes(ffi.buffer(inputs.data)),
+                                 bytes(ffi.buffer(solution.data)))
+
+    def _on_done(self, user_data, job_id, solutions):
+        job = ffi.from_handle(user_data)
+        job._finish()
+        self.jobs_.discard(job)
+
+    def submit(self, block_header, nonce_start=0, nonce_count=1,
+               max_solutions=None):
+        """Queues solving of nonces `nonce_start` .. `nonce_start +
+        nonce_count - 1` of `block_header` (`nonce_count` 0 means until
+        cancelled). A nonce replaces the last 8 bytes of the header
+        (little endian). The job ends after `max_solutions` solutions if given.
+        Returns a `SolverJob`.
+        """
+        assert len(block_header) == 140
+        job = SolverJob(self, max_solutions)
+        self.jobs_.add(job)
+        self.header_.data = block_header
+        job.id_ = library.SubmitJob(self.queue_, self.header_, nonce_start,
+                                    nonce_count, self.on_solution_,
+                                    self.on_done_, job.handle_)
+        assert job.id_ > 0
+        return job
+
+    def map(self, block_headers, nonce_start=0, nonce_count=1):
+        """Submits a job for each header, returns their `SolverJob`s."""
+        return [self.submit(header, nonce_start, nonce_count)
+                for header in block_headers]
+
+
+class Verifier:
+    """Validation only counterpart of Solver. It doesn't allocate memory
+    needed for solving, so it is cheap to have many instances.
+    """
+    def __init__(self):
+        self.verifier_ = self.header_ = self.minimal_tmp_ = None
+        if (library is None):
+            load_library()
+        assert library and ffi
+        self.verifier_ = library.CreateVerifier()
+        self.header_ = ffi.new("HeaderAndNonce*")
+        self.minimal_tmp_ = ffi.new("Solution*")
+
+    def __del__(self):
+        library.DestroyVerifier(self.verifier_)
+        self.verifier_ = None
+        self.header_ = self.minimal_tmp_ = None
+
+    def validate_solution(self, block_header, solution):
+        assert len(block_header) == 140
+        assert len(solution) == 1344
+        self.header_.data = block_header
+        self.minimal_tmp_.data = solution
+        return library.VerifySolution(self.verifier_, self.header_, self.minimal_tmp_)
+
+
+__all__ = ['Solver', 'SolverJob', 'SolverPool', 'Verifier', 'load_library', 'reserve_shared_arena',
+           'set_page_policy', 'PAGES_HUGETLB_1G', 'PAGES_HUGETLB_2M',
+           'PAGES_TRANSPARENT_HUGE', 'PAGES_PLAIN']
@@ -1,6 +1,7 @@
 from __future__ import print_function
-from pyzceqsolver.solver import Solver
+from pyzceqsolver.solver import Solver, SolverPool
 import string
+import struct
 import sys
 
 s = Solver()
@@ -32,3 +33,29 @@ for character in string.printable:
         result = s.validate_solution(block_header, solution[::-1])
         if result != 0:
             print("Error: solution should be rejected (%d)" % result)
+
+# Batched sweep: every solution is checked against the header rebuilt from
+# its origin (header index, nonce).
+headers = [b'A' * 140, b'B' * 140]
+out, origins = s.find_solutions_batch(headers, 7, 2)
+for i, (header_index, nonce) in enumerate(origins):
+    header = headers[header_index][:132] + struct.pack('<Q', nonce)
+    solution = bytes(out[i * 1344:(i + 1) * 1344])
+    result = s.validate_solution(header, solution)
+    if result != 1:
+        print("Error: invalid solution of a batch (%d)" % result)
+print(len(origins), 'solution(s) found by the batch')
+
+# Jobs of the native pool write the nonce over the last 8 bytes of the
+# header (little endian), each solution comes with the header it solves.
+pool = SolverPool(threads=2)
+block_header = b'Z' * 140
+job = pool.submit(block_header, nonce_start=5, nonce_count=2)
+for header, solution in job:
+    nonce = struct.unpack('<Q', header[132:])[0]
+    assert header[:132] == block_header[:132] and nonce in (5, 6)
+    result = s.validate_solution(header, solution)
+    if result != 1:
+        print("Error: invalid solution of a pool job (%d)" % result)
+print(len(job.result()), 'solution(s) found by the pool')
+pool.close()
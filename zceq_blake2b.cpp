@@ -456,11 +456,7 @@ void IntrinsicsBackend<batch_size>::Precompute(const u8* header_and_nonce, u64 l
 }
 
 __attribute__((target("avx2")))
-void IntrinsicsAVX2::Finalize(u32 g_start) {
-  // Fill g indices into the vectorized (transposed) block parts.
-  for (auto i : range(kBatchSize))
-    second_blockN_->dwords[1][2*i + 1] = g_start + i;
-
+void IntrinsicsAVX2::Compute() {
   memcpy(hash_out_vectors_, hash_init_vectors_, sizeof(Vectors8xN));
 
   // Compute 4 Blake2b hashes simultaneously!
@@ -473,11 +469,7 @@ void IntrinsicsAVX2::Finalize(u32 g_start) {
 }
 
 __attribute__((target("avx")))
-void IntrinsicsAVX1::Finalize(u32 g_start) {
-  // Fill g indices into the vectorized (transposed) block parts.
-  for (auto i : range(kBatchSize))
-    second_blockN_->dwords[1][2*i + 1] = g_start + i;
-
+void IntrinsicsAVX1::Compute() {
   memcpy(hash_out_vectors_, hash_init_vectors_, sizeof(Vectors8xN));
 
   // Compute 2 Blake2b hashes simultaneously!
@@ -490,11 +482,7 @@ void IntrinsicsAVX1::Finalize(u32 g_start) {
 }
 
 __attribute__((target("ssse3")))
-void IntrinsicsSSSE3::Finalize(u32 g_start) {
-  // Fill g indices into the vectorized (transposed) block parts.
-  for (auto i : range(kBatchSize))
-    second_blockN_->dwords[1][2*i + 1] = g_start + i;
-
+void IntrinsicsSSSE3::Compute() {
   memcpy(hash_out_vectors_, hash_init_vectors_, sizeof(Vectors8xN));
 
   // Compute 2 Blake2b hashes simultaneously!
@@ -508,13 +496,9 @@ void IntrinsicsSSSE3::Finalize(u32 g_start) {
 
 // FIXME: Temporarily changed sse2 to ssse3 before finding proper solutions for sse2.
 __attribute__((target("ssse3")))
-void IntrinsicsSSE2::Finalize(u32 g_start) {
+void IntrinsicsSSE2::Compute() {
   assert(false);
 
-  // Fill g indices into the vectorized (transposed) block parts.
-  for (auto i : range(kBatchSize))
-    second_blockN_->dwords[1][2*i + 1] = g_start + i;
-
   memcpy(hash_out_vectors_, hash_init_vectors_, sizeof(Vectors8xN));
 
   // Compute 2 Blake2b hashes simultaneously!
@@ -67,6 +67,18 @@ class BlakeBatchBackend {
   // Compute the hash(es), starting from index `g_start`.
   virtual void Finalize(u32 g_start) = 0;
 
+  // Returns true if the backend can compute hashes for arbitrary (not
+  // consecutive) indices by `FinalizeIndices`.
+  virtual bool CanFinalizeIndices() {
+    return false;
+  }
+
+  // Compute the hashes for indices `g_values` (one per hash in the batch).
+  virtual void FinalizeIndices(const u32* g_values) {
+    assert(false);
+    abort();
+  }
+
  protected:
   u8* AllocateAligned(u64 size) {
     assert(raw_memory_ == nullptr);
@@ -80,7 +92,9 @@ class BlakeBatchBackend {
 
 class alignas(32) Blake2b {
  public:
-  inline Blake2b();
+  // When `indexed_batches` is set, batch backends capable of computing
+  // hashes for arbitrary indices are preferred (the asm ones are not).
+  inline Blake2b(bool indexed_batches = false);
   inline ~Blake2b();
 
   void Precompute(const u8* header_and_nonce, u64 length) {
@@ -147,27 +161,45 @@ class alignas(32) Blake2b {
     batch_backend_->Finalize(g_start);
 
     if (Const::kRecomputeHashesByRefImpl) {
-      BatchHash* hash64 = (BatchHash*)batch_backend_->GetHashOutputMemory();
-      for (auto vec : range(batch_backend_->GetBatchSize())) {
-        // Copy the prepared state to local variable since it will be demaged
-        // by the computation.
-        State control_output = prepared_state_;
-        second_block_.s.g = g_start + vec;
-
-        blake2b_compress_ref((blake2b_state*) &control_output, second_block_.all_data);
-        // Compress4(&control_output, (u64*)second_block_.all_data);
-        for (auto part : range(7)) {
-          if (hash64[vec][part] != control_output.h64[part]) {
-            fprintf(stderr,
-                    "Hash produced by vectorized Blake2b is NOT THE SAME! \n");
-            abort();
-          }
-        }
-      }
+      for (auto vec : range(batch_backend_->GetBatchSize()))
+        CheckBatchHashByRefImpl(vec, g_start + vec);
+    }
+  }
+
+  inline bool CanBatchFinalizeIndices() {
+    return batch_backend_ != nullptr && batch_backend_->CanFinalizeIndices();
+  }
+
+  // Compute GetBatchSize() hashes for arbitrary indices `g_values`.
+  inline void BatchFinalizeIndices(const u32* g_values) {
+    assert(CanBatchFinalizeIndices());
+    batch_backend_->FinalizeIndices(g_values);
+
+    if (Const::kRecomputeHashesByRefImpl) {
+      for (auto vec : range(batch_backend_->GetBatchSize()))
+        CheckBatchHashByRefImpl(vec, g_values[vec]);
     }
   }
 
  protected:
+  void CheckBatchHashByRefImpl(u32 vec, u32 g) {
+    BatchHash* hash64 = (BatchHash*)batch_backend_->GetHashOutputMemory();
+    // Copy the prepared state to local variable since it will be demaged
+    // by the computation.
+    State control_output = prepared_state_;
+    second_block_.s.g = g;
+
+    blake2b_compress_ref((blake2b_state*) &control_output, second_block_.all_data);
+    // Compress4(&control_output, (u64*)second_block_.all_data);
+    for (auto part : range(7)) {
+      if (hash64[vec][part] != control_output.h64[part]) {
+        fprintf(stderr,
+                "Hash produced by vectorized Blake2b is NOT THE SAME! \n");
+        abort();
+      }
+    }
+  }
+
   void CompressSingle(State& state, const u8* data) {
     assert((u64)data % 32 == 0);
     blake2b_compress((blake2b_state*)&state, data);
@@ -233,7 +265,27 @@ class IntrinsicsBackend : public BlakeBatchBackend {
     return hash_output_;
   };
 
+  virtual void Finalize(u32 g_start) {
+    // Fill g indices into the vectorized (transposed) block parts.
+    for (auto i : range(kBatchSize))
+      second_blockN_->dwords[1][2*i + 1] = g_start + i;
+    Compute();
+  }
+
+  virtual bool CanFinalizeIndices() {
+    return true;
+  }
+
+  virtual void FinalizeIndices(const u32* g_values) {
+    for (auto i : range(kBatchSize))
+      second_blockN_->dwords[1][2*i + 1] = g_values[i];
+    Compute();
+  }
+
  protected:
+  // Compute the hashes for g indices already filled in the second blocks.
+  virtual void Compute() = 0;
+
   SecondBlockNonZeroN* second_blockN_ = nullptr;
   BatchHash* hash_output_ = nullptr;
   Vectors8xN* init_vectors_ = nullptr;
@@ -242,19 +294,19 @@ class IntrinsicsBackend : public BlakeBatchBackend {
 };
 
 class IntrinsicsAVX2 : public IntrinsicsBackend<4> {
-  virtual void Finalize(u32 g_start);
+  virtual void Compute();
 };
 
 class IntrinsicsAVX1 : public IntrinsicsBackend<2> {
-  virtual void Finalize(u32 g_start);
+  virtual void Compute();
 };
 
 class IntrinsicsSSSE3 : public IntrinsicsBackend<2> {
-  virtual void Finalize(u32 g_start);
+  virtual void Compute();
 };
 
 class IntrinsicsSSE2 : public IntrinsicsBackend<2> {
-  virtual void Finalize(u32 g_start);
+  virtual void Compute();
 };
 
 class AsmAVX2 : public BlakeBatchBackend {
@@ -311,7 +363,7 @@ class AsmAVX1 : public BlakeBatchBackend {
   BatchHash* hash_output_ = nullptr;
 };
 
-inline Blake2b::Blake2b() {
+inline Blake2b::Blake2b(bool indexed_batches) {
   // Pick best implementation for scalar blake2b, based on allowed
   // instruction sets and actual CPU.
   {
@@ -337,13 +389,13 @@ inline Blake2b::Blake2b() {
     auto& allowed = RunTimeConfig.kBatchBlakeAllowed;
     // AVX2
     if (allowed.AVX2 && HasAvx2Support()) {
-      if (RunTimeConfig.kUseAsmBlake2b)
+      if (RunTimeConfig.kUseAsmBlake2b && !indexed_batches)
         batch_backend_ = new AsmAVX2();
       else
         batch_backend_ = new IntrinsicsAVX2();
       // AVX1
     } else if (allowed.AVX1 && HasAvx1Support()) {
-      if (RunTimeConfig.kUseAsmBlake2b)
+      if (RunTimeConfig.kUseAsmBlake2b && !indexed_batches)
         batch_backend_ = new AsmAVX1();
       else
         batch_backend_ = new IntrinsicsAVX1();
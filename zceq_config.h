@@ -20,6 +20,23 @@ struct InstructionSet {
   bool SSE2 = false;
 };
 
+// Kind of memory pages used for the solver memory pool. When pages of
+// the requested kind can't be obtained, the next (smaller) kind is tried.
+enum class PagePolicy : int {
+  // Explicitly reserved 1GB pages (hugetlbfs), the whole pool of a solver
+  // is then covered by a single TLB entry.
+  kHugeTlb1G = 0,
+  // Explicitly reserved 2MB pages (hugetlbfs).
+  kHugeTlb2M = 1,
+  // Transparent huge pages requested by madvise(MADV_HUGEPAGE), works
+  // without any reservation when THP is set to `madvise` or `always`.
+  kTransparentHuge = 2,
+  // Standard 4kB pages.
+  kPlain = 3,
+};
+
+const char* GetPagePolicyName(PagePolicy policy);
+
 // Configuration structure which can be altered during run-time.
 // Mainly intended for command line switches.
 struct RTConfig {
@@ -33,6 +50,8 @@ struct RTConfig {
   // Turn off to force the solver to use intrinsics-based blake2b
   // implementations.
   bool kUseAsmBlake2b = true;
+  // Preferred kind of memory pages for solver memory pools.
+  PagePolicy kPagePolicy = PagePolicy::kHugeTlb2M;
 };
 
 // Global instance of the CPU configuration.
@@ -71,6 +90,9 @@ namespace Const {
   static constexpr u32 kInitialStringSetSize = 1u << (kHashSegmentBits + 1);
   // Number of indices in a solution.
   static constexpr u32 kSolutionSize = 1u << (kTotalSegmentsCount - 1);
+  // Bytes of a solution in minimal encoding (indices of
+  // `kHashSegmentBits` + 1 bits packed together).
+  static constexpr u32 kMinimalSolutionBytes = kSolutionSize * (kHashSegmentBits + 1) / 8;
 
   // ---
   // Algorithm parameters - they modify behaviour of the solver and
@@ -115,6 +137,12 @@ namespace Const {
   // low but it allows to filter a lot of invalid candidate solutions
   // cheaply.
   static constexpr bool kStep8FilterByLastSegment = true;
+  // If set, the final step (step8) is run by a dedicated engine instead
+  // of the generic reduction step. It needs no histogram, it matches
+  // all remaining hash bits at once in a single pass over each bucket
+  // using a sparse hash table. Groups of `kTooManyFinalCollisions` or
+  // more equal strings are eliminated.
+  static constexpr bool kUseFinalStepEngine = true;
   // TODO: Not properly supported in this version of the solver.
   // Do not change it.
   static constexpr bool kStoreIndicesEarly = false;
@@ -129,6 +157,17 @@ namespace Const {
   // solution candidates are collected similarly to output strings in
   // earlier steps and then processed together.
   static constexpr bool kProcessSolutionCandidateEarly = false;
+  // If set (and `kProcessSolutionCandidateEarly` is not), step8 pushes
+  // solution candidates into a ring buffer and a companion thread
+  // validates them while the collision search still runs. The
+  // validation then doesn't pollute caches of the searching thread
+  // and its latency overlaps with the step. The companion thread is
+  // started with the solver and sleeps between runs.
+  static constexpr bool kProcessSolutionCandidatesInThread = false;
+  // Number of solution candidates the ring buffer can hold. When the
+  // ring is full, step8 waits for the companion thread. Must be a
+  // power of 2.
+  static constexpr u32 kSolutionCandidateRingSize = 4096;
   // Algorithm steps 0 .. (kUseTemporaryHashArrayBeforeStep - 1) uses
   // temporary array to store a part of first segment values for
   // second iteration over string. The temporary array helps to keep
@@ -143,11 +182,28 @@ namespace Const {
   // alignment affects which and how many instructions is used and can
   // measurably affect performance. Must be a power of 2.
   static constexpr u64 kXORAlignment = 4ul;
+  // Number of output positions a thread claims at once in an output
+  // bucket when a reduction step runs in more threads (see
+  // `Solver::SetStepThreads`). Positions are claimed by an atomic
+  // increment of the bucket counter, the rest of the chunk is filled
+  // without any synchronization. Larger chunks mean less contention on
+  // counters but more holes (a partly filled chunk per thread and
+  // bucket) to be removed when the partition is closed.
+  static constexpr u32 kOutputChunkSize = 64;
+  // Low memory mode for small machines. Output string sets are sized
+  // exactly for the output string type (not the input one) and buckets
+  // have only 10% extra space instead of 40%. It costs about 1% of
+  // solutions (strings discarded by full buckets), not CPU time. The
+  // peak footprint drops from ~180MB to ~133MB. Note that going much
+  // lower is not possible with the current string sets: steps 0 and 1
+  // need both their input and output sets alive, i.e. 52 or more bytes
+  // per string (2^21 strings) without link indices.
+  static constexpr bool kLowMemoryMode = false;
   // Multiplier and divisor for computing maximum number of strings the
   // solver can use in any algorithm step. The coefficients are related to
   // initial number of generated strings.
-  static constexpr u64 kExtraSpaceMultiplier = 7;
-  static constexpr u64 kExtraSpaceDivisor = 5;
+  static constexpr u64 kExtraSpaceMultiplier = kLowMemoryMode ? 11 : 7;
+  static constexpr u64 kExtraSpaceDivisor = kLowMemoryMode ? 10 : 5;
   // Number of bits used for encoding a bucket. Directly defines number
   // of buckets used by the solver.
   static constexpr u64 kBucketCountBits = 9;
@@ -170,6 +226,8 @@ namespace Const {
   // distribution for random strings. This hugely helps to keep the
   // string set small and "healthy".
   static constexpr u32 kTooManyBasicCollisions = 14;
+  // The same for strings with all remaining bits equal in the final
+  // step (used by `kUseFinalStepEngine`).
   static constexpr u32 kTooManyFinalCollisions = 3;
   // This option defines software pre-fetching behaviour during output
   // string generation in each step (collision groups processing). We
@@ -179,14 +237,37 @@ namespace Const {
   // thru, so we can try to prefetch them. The following number defines
   // a distance of the prefetch (in number of strings).
   static constexpr u64 kPrefetchDistance = 16;
+  // Cache coloring. Buckets of a string set lie `kItemsInBucket` strings
+  // apart and string sets start at page aligned slots, so bucket `b` of
+  // the input set and bucket `b` of the output set (or of a link index)
+  // can map to the same cache sets and evict each other, an issue mainly
+  // for caches with low associativity. `kBucketPadding` adds the given
+  // number of unused strings behind each bucket (it shifts the bucket
+  // stride), `kSpaceColoring` shifts a start of each memory space by a
+  // multiple of the given number of bytes (`kSpaceColors` different
+  // offsets are used). Zero values mean no coloring. On a 12-way L1d and
+  // 16-way L2 no coloring tried (padding 1, 3 and 16 strings, space
+  // offsets of 1088 and 4160 bytes) was measurably better, caches with
+  // fewer ways (8-way L2) are the candidates for trying it.
+  static constexpr u32 kBucketPadding = 0;
+  static constexpr u64 kSpaceColoring = 0;
+  static constexpr u32 kSpaceColors = 4;
   // Bytes allocated per one string for the whole algorithm run. This
   // memory is managed by a space allocator which allows to reallocate
   // memory blocks to different data structure quite cheaply. This
   // value is used if `kExpandHashes` == true.
   static constexpr u64 kMemoryForExpandedProblem = 76ul;
+  // Number of solution objects allocated with the solver. A run
+  // producing more solutions allocates more of them (rare).
+  static constexpr u32 kPreallocatedSolutions = 16;
   // Bytes allocated per one string for `kExpandHashes` == false.
   static constexpr u64 kMemoryForNonExpandedProblem =
       68ul - (kFirstSegmentBitsSkipped ? 4 : 0);
+  // Bytes allocated per one string for `kLowMemoryMode` (and
+  // `kExpandHashes` == false). It is given by step 0: two string sets
+  // and one link index.
+  static constexpr u64 kMemoryForLowMemoryMode =
+      64ul - (kFirstSegmentBitsSkipped ? 4 : 0);
 
   // ---
   // Debugging flags - should be always false if you're not debugging
@@ -241,6 +322,8 @@ namespace Const {
   static constexpr u32 kItemsInBucket =
     kInitialStringSetSize * kExtraSpaceMultiplier / kExtraSpaceDivisor
     / kBucketCount;
+  // Distance between starts of two consecutive buckets (in strings).
+  static constexpr u32 kBucketStride = kItemsInBucket + kBucketPadding;
   // Maximum value for encoding for two strings referenced by a pair
   // link. TODO: Use actual pairing function as used in the code.
   static constexpr u64 kMaxCompressedIndexValue =
@@ -254,6 +337,13 @@ namespace Const {
   static constexpr u64 kHashTableSizeBits = kHashSegmentBits - kBucketCountBits;
   static constexpr u64 kHashTableMask = (1u << kHashTableSizeBits) - 1;
   static constexpr u16 kHashTableSize = (1u << kHashTableSizeBits);
+  // Hash table used by the final step engine (`kUseFinalStepEngine`).
+  // It has twice as many slots as strings expected in a bucket, so that
+  // it is sparse but still fits into L1/L2 next to the bucket.
+  static constexpr u32 kFinalTableSizeBits =
+      (kHashSegmentBits + 1 - kBucketCountBits) + 1;
+  static constexpr u32 kFinalTableMask = (1u << kFinalTableSizeBits) - 1;
+  static constexpr u32 kFinalTableSize = (1u << kFinalTableSizeBits);
 
   // Number of bits we need to reproduce by position of pair link
   // object (amount of information we don't have space for). We expect
@@ -273,16 +363,23 @@ namespace Const {
   // all partitions are fully used. This number is used mainly for
   // space allocation.
   static constexpr u64 kMaximumStringSetSize =
-      kInitialStringSetSize * kExtraSpaceMultiplier / kExtraSpaceDivisor;
+      kInitialStringSetSize * kExtraSpaceMultiplier / kExtraSpaceDivisor
+      + kBucketPadding * kBucketCount;
 
   // Sanity checks.
   static_assert(kExtraSpaceMultiplier > kExtraSpaceDivisor,
 		"Some additional space is required");
   static_assert(kCheckBucketOverflow || kRecomputeSolution,
 		"At least one of the options must be enabled");
+  static_assert(!kProcessSolutionCandidateEarly ||
+                !kProcessSolutionCandidatesInThread,
+		"At most one of the options can be enabled");
   static_assert(kItemsInBucket <= 0xffff,
 		"Items in bucket cannot fit into u16");
+  static_assert(kSpaceColors > 0, "At least one color is needed");
   static_assert(kPartitionCountBits < 10, "Expression overflowed");
+  static_assert(!kLowMemoryMode || !kExpandHashes,
+		"Low memory mode doesn't support expanded hashes");
   static_assert(kItemsInOutPartition * kPartitionCount <= kItemsInBucket,
 		"Inconsistent partition vs. bucket configuration");
   static_assert((kItemsInOutPartition + 1) * kPartitionCount > kItemsInBucket,
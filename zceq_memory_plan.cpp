@@ -0,0 +1,151 @@
+/* Copyright @ 2016 Pavel Moravec */
+#include <algorithm>
+#include <cstring>
+#include "zceq_memory_plan.h"
+
+namespace zceq_solver {
+
+// First free range of `size` slots in `stage`, `slot_count` if none.
+static u32 FindFirstFit(const MemoryPlan::Stage& stage, u32 size, u32 slot_count) {
+  std::vector<bool> used(slot_count);
+  for (auto& placement : stage) {
+    for (auto slot = placement.place;
+         slot < std::min(placement.place + placement.size, slot_count); ++slot)
+      used[slot] = true;
+  }
+  u32 count = 0;
+  for (auto slot : range(slot_count)) {
+    count = used[slot] ? 0 : count + 1;
+    if (count >= size)
+      return (u32)slot + 1 - size;
+  }
+  return slot_count;
+}
+
+MemoryPlan MemoryPlan::Build(u32 generated_size, const std::vector<StepSizes>& steps,
+                             u32 slot_count) {
+  MemoryPlan plan;
+  plan.slot_count_ = slot_count;
+  plan.space_count_ = kFirstLinkIndex + (u32)steps.size();
+
+  Stage stage(plan.space_count_);
+  auto allocate = [&](u32 space, u32 size) {
+    stage[space].size = 0;
+    auto place = FindFirstFit(stage, size, slot_count);
+    if (place == slot_count) {
+      plan.valid_ = false;
+      place = 0;
+    }
+    stage[space].place = place;
+    stage[space].size = size;
+  };
+
+  allocate(kX2, generated_size);
+  allocate(kX1, generated_size);
+  plan.stages_.push_back(stage);
+
+  for (auto step : range((u32)steps.size())) {
+    auto& sizes = steps[step];
+    auto in_space = (step % 2 == 0) ? kX1 : kX2;
+    auto out_space = (step % 2 == 0) ? kX2 : kX1;
+    if (sizes.in_size != 0)
+      stage[in_space].size = sizes.in_size;
+    if (sizes.out_size != 0)
+      allocate(out_space, sizes.out_size);
+    allocate(kFirstLinkIndex + step, sizes.link_size);
+    plan.stages_.push_back(stage);
+  }
+  return plan;
+}
+
+bool MemoryPlan::Verify() const {
+  bool result = valid_;
+  if (!valid_)
+    fprintf(stderr, "MemoryPlan: not enough slots for some space\n");
+
+  for (auto s : range(GetStageCount())) {
+    auto& stage = stages_[s];
+    for (auto i : range(space_count_)) {
+      auto& a = stage[i];
+      if (a.size == 0)
+        continue;
+      if (a.place + a.size > slot_count_) {
+        fprintf(stderr, "MemoryPlan: stage %d: %s out of the pool\n", s, GetSpaceName(i));
+        result = false;
+      }
+      for (auto j : range(i + 1, space_count_)) {
+        auto& b = stage[j];
+        if (b.size != 0 && a.place < b.place + b.size && b.place < a.place + a.size) {
+          fprintf(stderr, "MemoryPlan: stage %d: %s and %s overlap\n", s,
+                  GetSpaceName(i), GetSpaceName(j));
+          result = false;
+        }
+      }
+    }
+    if (s == 0)
+      continue;
+
+    // Step `s - 1` reads strings written by the previous stage and all
+    // link indices are needed until the end.
+    auto& previous = stages_[s - 1];
+    auto in_space = ((s - 1) % 2 == 0) ? kX1 : kX2;
+    if (stage[in_space].place != previous[in_space].place ||
+        stage[in_space].size > previous[in_space].size) {
+      fprintf(stderr, "MemoryPlan: stage %d: input %s moved\n", s, GetSpaceName(in_space));
+      result = false;
+    }
+    for (auto i : range(kFirstLinkIndex, space_count_)) {
+      if (previous[i].size != 0 && previous[i] != stage[i]) {
+        fprintf(stderr, "MemoryPlan: stage %d: %s moved\n", s, GetSpaceName(i));
+        result = false;
+      }
+    }
+  }
+  return result;
+}
+
+u32 MemoryPlan::GetPeakSlots() const {
+  u32 peak = 0;
+  for (auto& stage : stages_) {
+    u32 used = 0;
+    for (auto& placement : stage)
+      used += placement.size;
+    peak = std::max(peak, used);
+  }
+  return peak;
+}
+
+const char* MemoryPlan::GetSpaceName(u32 space) {
+  static const char* const kNames[] = {
+      "X1", "X2", "I0", "I1", "I2", "I3", "I4", "I5", "I6", "I7", "I8", "I9"};
+  return space < sizeof kNames / sizeof kNames[0] ? kNames[space] : "?";
+}
+
+void MemoryPlan::Dump(FILE* output) const {
+  std::vector<char> line(slot_count_ + 1);
+  for (auto s : range(GetStageCount())) {
+    std::fill(line.begin(), line.end() - 1, ' ');
+    line[slot_count_] = 0;
+    u32 used = 0;
+    for (auto i : range(space_count_)) {
+      auto& placement = stages_[s][i];
+      if (placement.size == 0 || placement.place + placement.size > slot_count_)
+        continue;
+      used += placement.size;
+      auto begin = &line[placement.place];
+      std::fill(begin, begin + placement.size, '.');
+      begin[0] = '[';
+      begin[placement.size - 1] = ']';
+      auto name = GetSpaceName(i);
+      auto name_length = std::min((u32)strlen(name), placement.size > 2 ? placement.size - 2 : 0);
+      memcpy(begin + (placement.size - name_length) / 2, name, name_length);
+    }
+    if (s == 0)
+      fprintf(output, "%s<-- generation (%d slots)\n", line.data(), used);
+    else
+      fprintf(output, "%s<-- step %d (%d slots)\n", line.data(), s - 1, used);
+  }
+  fprintf(output, "Peak: %d of %d slots\n", GetPeakSlots(), slot_count_);
+}
+
+}  // namespace zceq_solver
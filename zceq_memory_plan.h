@@ -0,0 +1,85 @@
+/* Copyright @ 2016 Pavel Moravec */
+#ifndef ZCEQ_MEMORY_PLAN_H_
+#define ZCEQ_MEMORY_PLAN_H_
+
+#include <cstdio>
+#include <vector>
+#include "zceq_misc.h"
+
+namespace zceq_solver {
+
+// Placement of all solver spaces (two string sets and link indices) in
+// the memory pool for the whole run. Sizes of the spaces are given by
+// step configurations only, so the placement can be computed once and
+// reused for all runs instead of searching for free slots every time.
+//
+// The plan consists of stages: the string generation and then one stage
+// for each step. A stage lists slots of all spaces alive during it.
+class MemoryPlan {
+ public:
+  // Space identifiers, link indices follow the string sets.
+  static constexpr u32 kX1 = 0;
+  static constexpr u32 kX2 = 1;
+  static constexpr u32 kFirstLinkIndex = 2;
+
+  struct Placement {
+    u32 place = 0;
+    // In slots, 0 for a space not allocated in the stage.
+    u32 size = 0;
+    bool operator!=(const Placement& other) const {
+      return place != other.place || size != other.size;
+    }
+  };
+  using Stage = std::vector<Placement>;
+
+  // Sizes of spaces (in slots) changed by a step, 0 means no change.
+  struct StepSizes {
+    u32 in_size = 0;
+    u32 out_size = 0;
+    u32 link_size = 0;
+  };
+
+  // Places the spaces by first-fit in the same order as the solver used
+  // to allocate them: both string sets before generation, then for each
+  // step its input set is shrunk in place, its output set is moved and
+  // its link index is added. Step `s` reads X1 for even `s`.
+  static MemoryPlan Build(u32 generated_size, const std::vector<StepSizes>& steps,
+                          u32 slot_count);
+
+  // Checks that spaces alive at the same time don't overlap and fit into
+  // the pool, and that spaces holding data needed later (the next step's
+  // input, link indices) are not moved. Problems are printed.
+  bool Verify() const;
+  void Dump(FILE* output) const;
+
+  const Stage& GetStage(u32 stage) const {
+    return stages_[stage];
+  }
+  u32 GetStageCount() const {
+    return (u32)stages_.size();
+  }
+  u32 GetSpaceCount() const {
+    return space_count_;
+  }
+  // The most slots used by one stage.
+  u32 GetPeakSlots() const;
+  u32 GetSlotCount() const {
+    return slot_count_;
+  }
+  bool IsValid() const {
+    return valid_;
+  }
+
+ protected:
+  static const char* GetSpaceName(u32 space);
+
+  std::vector<Stage> stages_;
+  u32 space_count_ = 0;
+  u32 slot_count_ = 0;
+  // False when first-fit didn't find a place for some space.
+  bool valid_ = true;
+};
+
+}  // namespace zceq_solver
+
+#endif  // ZCEQ_MEMORY_PLAN_H_
@@ -2,10 +2,17 @@
 #ifndef ZCEQ_MISC_H_
 #define ZCEQ_MISC_H_
 
+#include <atomic>
 #include <cinttypes>
+#include <cstdlib>
 #include <cstring>
 #include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
 #include <cpuid.h>
 #include <x86intrin.h>
 
@@ -54,6 +61,34 @@ class ScopeTimer {
   std::function<void(u64)> callback_;
 };
 
+// Base for classes with extended alignment (AVX state, cache line padded
+// members). Plain C++11 `new` only guarantees alignof(max_align_t), so heap
+// instances of such classes are allocated aligned to a cache line here.
+class AlignedNew {
+ public:
+  static constexpr std::size_t kAlignment = 64;
+
+  static void* operator new(std::size_t size) {
+    void* memory = nullptr;
+#ifdef __WINDOWS__
+    memory = _aligned_malloc(size, kAlignment);
+#else
+    if (posix_memalign(&memory, kAlignment, size) != 0)
+      memory = nullptr;
+#endif
+    if (memory == nullptr)
+      throw std::bad_alloc();
+    return memory;
+  }
+  static void operator delete(void* memory) {
+#ifdef __WINDOWS__
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+  }
+};
+
 
 template<typename T>
 struct range_ {
@@ -201,6 +236,134 @@ class Random {
 };
 
 
+// Lock-free queue of a fixed capacity for exactly one producer thread
+// and one consumer thread. Heap allocated so that its cache line
+// alignment does not propagate to the owning object.
+template<typename T, u32 capacity>
+class SPSCRing : public AlignedNew {
+  static_assert((capacity & (capacity - 1)) == 0, "Capacity must be a power of 2");
+ public:
+  // Must not be called while any of the threads uses the ring.
+  void Reset() {
+    head_.store(0, std::memory_order_relaxed);
+    tail_.store(0, std::memory_order_relaxed);
+  }
+  // Producer side. Returns false when the ring is full.
+  bool Push(const T& item) {
+    auto head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == capacity)
+      return false;
+    items_[head % capacity] = item;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+  // Consumer side. Returns false when the ring is empty.
+  bool Pop(T& item) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire))
+      return false;
+    item = items_[tail % capacity];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+ protected:
+  // Keep the producer and consumer positions on separate cache lines.
+  alignas(64) std::atomic<u32> head_{0};
+  alignas(64) std::atomic<u32> tail_{0};
+  alignas(64) T items_[capacity];
+};
+
+// Fixed group of threads running one task at a time. `Run` calls the
+// task with member index 0 in the calling thread and 1 .. size - 1 in the
+// team threads and returns when all of them are done. The threads are
+// started once and sleep between tasks.
+class ThreadTeam {
+ public:
+  // `size` includes the calling thread.
+  explicit ThreadTeam(u32 size) {
+    for (u32 index = 1; index < size; ++index)
+      threads_.emplace_back(&ThreadTeam::ThreadMain, this, index);
+  }
+  ThreadTeam(const ThreadTeam&) = delete;
+  ~ThreadTeam() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    start_cv_.notify_all();
+    for (auto& thread : threads_)
+      thread.join();
+  }
+
+  u32 GetSize() {
+    return (u32)threads_.size() + 1;
+  }
+
+  void Run(const std::function<void(u32)>& task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &task;
+      running_ = (u32)threads_.size();
+      round_++;
+    }
+    start_cv_.notify_all();
+    task(0);
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this]() { return running_ == 0; });
+    task_ = nullptr;
+  }
+
+  // Called by all members of a running task, returns when all of them
+  // arrived. Writes done before it are visible to all members after it.
+  // Members wait actively, the phases of a task are expected to be short.
+  void Barrier() {
+    auto phase = barrier_phase_.load(std::memory_order_acquire);
+    if (barrier_arrived_.fetch_add(1, std::memory_order_acq_rel) + 1 == GetSize()) {
+      barrier_arrived_.store(0, std::memory_order_relaxed);
+      barrier_phase_.store(phase + 1, std::memory_order_release);
+    } else {
+      while (barrier_phase_.load(std::memory_order_acquire) == phase)
+        std::this_thread::yield();
+    }
+  }
+
+ protected:
+  void ThreadMain(u32 index) {
+    u64 round = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      start_cv_.wait(lock, [&]() { return stopping_ || round_ != round; });
+      if (stopping_)
+        break;
+      round = round_;
+      auto task = task_;
+      lock.unlock();
+      (*task)(index);
+      lock.lock();
+      if (--running_ == 0)
+        done_cv_.notify_one();
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  const std::function<void(u32)>* task_ = nullptr;
+  u64 round_ = 0;
+  // Team threads which haven't finished the current task.
+  u32 running_ = 0;
+  bool stopping_ = false;
+  std::atomic<u32> barrier_arrived_{0};
+  std::atomic<u32> barrier_phase_{0};
+};
+
+// Non-temporal store of a single dword, `dest` must be 4B aligned.
+static inline void store_nt_u32(void* dest, u32 value) {
+  _mm_stream_si32((int*)dest, (int)value);
+}
+
 template<u64 length>
 static inline void memcpy_nt(void* __restrict dest,
                              const void* __restrict source) {
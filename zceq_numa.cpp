@@ -0,0 +1,178 @@
+/* Copyright @ 2016 Pavel Moravec */
+#include "portable_endian.h"
+#ifndef __WINDOWS__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include <cstdio>
+#include <cstdlib>
+#include "zceq_numa.h"
+
+namespace zceq_solver {
+
+// Memory policy constants of the mbind/set_mempolicy syscalls
+// (linux/mempolicy.h). We call them directly to not depend on libnuma.
+static constexpr int kMpolPreferred = 1;
+static constexpr unsigned kMpolMfMove = 1u << 1;
+static constexpr i32 kMaxNodes = 64;
+
+#ifndef __WINDOWS__
+// Parses a sysfs list like "0-3,8,10-11".
+static std::vector<u32> ParseCpuList(const char* path) {
+  std::vector<u32> result;
+  auto file = fopen(path, "r");
+  if (file == nullptr)
+    return result;
+  unsigned first, last;
+  while (fscanf(file, "%u", &first) == 1) {
+    last = first;
+    auto separator = fgetc(file);
+    if (separator == '-') {
+      if (fscanf(file, "%u", &last) != 1)
+        break;
+      separator = fgetc(file);
+    }
+    for (auto cpu = first; cpu <= last; ++cpu)
+      result.push_back(cpu);
+    if (separator != ',')
+      break;
+  }
+  fclose(file);
+  return result;
+}
+
+static NumaTopology ReadTopology() {
+  NumaTopology topology;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof allowed, &allowed) != 0) {
+    for (auto cpu : range(CPU_SETSIZE))
+      CPU_SET(cpu, &allowed);
+  }
+
+  auto nodes = ParseCpuList("/sys/devices/system/node/online");
+  for (auto node : nodes) {
+    if (node >= (u32)kMaxNodes)
+      break;
+    char path[64];
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%u/cpulist", node);
+    NumaTopology::Node entry;
+    entry.id = (i32)node;
+    for (auto cpu : ParseCpuList(path)) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+        entry.cpus.push_back(cpu);
+    }
+    // Memory-only nodes and nodes we can't run on are not interesting.
+    if (!entry.cpus.empty())
+      topology.nodes.push_back(entry);
+  }
+
+  if (topology.nodes.empty()) {
+    NumaTopology::Node entry;
+    entry.id = 0;
+    for (auto cpu : range(CPU_SETSIZE)) {
+      if (CPU_ISSET(cpu, &allowed))
+        entry.cpus.push_back((u32)cpu);
+    }
+    topology.nodes.push_back(entry);
+  }
+
+  // Group CPUs of each node by their siblings, a CPU without the sysfs
+  // information is a core on its own.
+  for (auto& node : topology.nodes) {
+    std::vector<bool> assigned(CPU_SETSIZE, false);
+    for (auto cpu : node.cpus) {
+      if (assigned[cpu])
+        continue;
+      char path[96];
+      snprintf(path, sizeof path,
+               "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu);
+      std::vector<u32> core;
+      for (auto sibling : ParseCpuList(path)) {
+        if (sibling < CPU_SETSIZE && CPU_ISSET(sibling, &allowed) && !assigned[sibling]) {
+          assigned[sibling] = true;
+          core.push_back(sibling);
+        }
+      }
+      if (!assigned[cpu]) {
+        assigned[cpu] = true;
+        core.push_back(cpu);
+      }
+      topology.cores.push_back(core);
+    }
+  }
+  return topology;
+}
+#endif
+
+const NumaTopology& NumaTopology::Get() {
+#ifdef __WINDOWS__
+  static NumaTopology topology = [] {
+    NumaTopology result;
+    result.nodes.push_back({0, {0}});
+    result.cores.push_back({0});
+    return result;
+  }();
+#else
+  static NumaTopology topology = ReadTopology();
+#endif
+  return topology;
+}
+
+u32 NumaTopology::GetCpuCount() const {
+  u32 count = 0;
+  for (auto& node : nodes)
+    count += (u32)node.cpus.size();
+  return count;
+}
+
+i32 GetCurrentNumaNode() {
+#ifdef __WINDOWS__
+  return 0;
+#else
+  unsigned cpu = 0, node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+    return 0;
+  return (i32)node;
+#endif
+}
+
+bool PinThreadToCpu(u32 cpu) {
+#ifdef __WINDOWS__
+  return false;
+#else
+  if (cpu >= CPU_SETSIZE)
+    return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof set, &set) == 0;
+#endif
+}
+
+bool SetThreadMemoryNode(i32 node) {
+#ifdef __WINDOWS__
+  return false;
+#else
+  if (!NumaTopology::Get().IsNuma() || node < 0 || node >= kMaxNodes)
+    return false;
+  unsigned long node_mask = 1ul << node;
+  return syscall(SYS_set_mempolicy, kMpolPreferred, &node_mask,
+                 sizeof(node_mask) * 8) == 0;
+#endif
+}
+
+bool BindMemoryToNode(void* address, u64 size, i32 node, bool move) {
+#ifdef __WINDOWS__
+  return false;
+#else
+  if (!NumaTopology::Get().IsNuma() || node < 0 || node >= kMaxNodes)
+    return false;
+  unsigned long node_mask = 1ul << node;
+  return syscall(SYS_mbind, address, size, kMpolPreferred, &node_mask,
+                 sizeof(node_mask) * 8, move ? kMpolMfMove : 0u) == 0;
+#endif
+}
+
+}  // namespace zceq_solver
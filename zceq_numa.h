@@ -0,0 +1,49 @@
+/* Copyright @ 2016 Pavel Moravec */
+#ifndef ZCEQ_NUMA_H_
+#define ZCEQ_NUMA_H_
+
+#include <vector>
+#include "zceq_misc.h"
+
+namespace zceq_solver {
+
+// NUMA nodes and CPUs the process may run on. It is read from sysfs, on
+// systems without NUMA information, there is a single node with all
+// allowed CPUs.
+struct NumaTopology {
+  struct Node {
+    i32 id;
+    std::vector<u32> cpus;
+  };
+  std::vector<Node> nodes;
+  // Allowed CPUs grouped by physical cores (hyper-threading siblings).
+  std::vector<std::vector<u32>> cores;
+
+  static const NumaTopology& Get();
+  bool IsNuma() const {
+    return nodes.size() > 1;
+  }
+  u32 GetCpuCount() const;
+  bool HasSmt() const {
+    return cores.size() < GetCpuCount();
+  }
+};
+
+// Returns NUMA node of the CPU the calling thread runs on.
+i32 GetCurrentNumaNode();
+
+// Restricts the calling thread to one CPU. Returns false on failure.
+bool PinThreadToCpu(u32 cpu);
+
+// Makes the memory faulted in by the calling thread prefer `node`
+// (set_mempolicy). No-op on single node systems.
+bool SetThreadMemoryNode(i32 node);
+
+// Binds (already mapped) memory range to `node` (mbind), pages already
+// faulted in elsewhere are moved when `move` is set. The range must be
+// page aligned. No-op on single node systems.
+bool BindMemoryToNode(void* address, u64 size, i32 node, bool move);
+
+}  // namespace zceq_solver
+
+#endif  // ZCEQ_NUMA_H_
@@ -0,0 +1,414 @@
+/* Copyright @ 2016 Pavel Moravec */
+#include <algorithm>
+#include <thread>
+
+#include "zceq_numa.h"
+#include "zceq_runner.h"
+
+namespace zceq_solver {
+
+// Returns index of the node in `topology.nodes` which has `cpu`.
+static u32 FindNodeIndex(const NumaTopology& topology, u32 cpu) {
+  for (auto index : range((u32)topology.nodes.size())) {
+    auto& cpus = topology.nodes[index].cpus;
+    if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end())
+      return index;
+  }
+  return 0;
+}
+
+NumaRunner::NumaRunner(u32 thread_count, const PoolOptions& pool_options,
+                       SmtMode smt_mode)
+    : pool_options_(pool_options), smt_mode_(smt_mode), next_nonce_(0) {
+  auto& topology = NumaTopology::Get();
+  if (thread_count == 0)
+    thread_count = topology.GetCpuCount();
+
+  for (auto& node : topology.nodes) {
+    NodeReport report;
+    report.node = node.id;
+    reports_.push_back(report);
+  }
+  auto node_count = (u32)topology.nodes.size();
+  if (smt_mode_ == SmtMode::kIndependent) {
+    // Round robin over nodes, then over CPUs of the node.
+    for (auto thread : range(thread_count)) {
+      auto node_index = thread % node_count;
+      auto& node = topology.nodes[node_index];
+      Placement placement;
+      placement.cpu = node.cpus[(thread / node_count) % node.cpus.size()];
+      placement.node = node.id;
+      placement.report = node_index;
+      placement.pair = 0;
+      placements_.push_back(placement);
+      reports_[node_index].threads++;
+    }
+  } else {
+    // Pairs of threads go to cores, round robin over nodes.
+    std::vector<std::vector<const std::vector<u32>*>> node_cores(node_count);
+    for (auto& core : topology.cores)
+      node_cores[FindNodeIndex(topology, core[0])].push_back(&core);
+    for (auto thread : range(thread_count)) {
+      auto pair = thread / 2;
+      auto node_index = pair % node_count;
+      auto& cores = node_cores[node_index];
+      auto& core = *cores[(pair / node_count) % cores.size()];
+      Placement placement;
+      placement.cpu = core[(thread % 2) % core.size()];
+      placement.node = topology.nodes[node_index].id;
+      placement.report = node_index;
+      placement.pair = pair;
+      placements_.push_back(placement);
+      reports_[node_index].threads++;
+    }
+    for (auto pair : range((thread_count + 1) / 2)) {
+      (void)pair;
+      pairs_.emplace_back(new ThreadPair());
+    }
+  }
+  solvers_.resize(thread_count);
+}
+
+void NumaRunner::ResetReport() {
+  for (auto& report : reports_) {
+    report.iterations = 0;
+    report.solutions = 0;
+    report.busy_micro = 0;
+  }
+}
+
+u64 NumaRunner::Run(const Inputs& inputs, u64 nonce_start, u32 iterations) {
+  u64 solutions_before = 0;
+  for (auto& report : reports_)
+    solutions_before += report.solutions;
+
+  next_nonce_ = nonce_start;
+  for (auto& pair : pairs_) {
+    pair->members = 0;
+    pair->arrived = 0;
+    pair->generating = false;
+  }
+  for (auto& placement : placements_) {
+    if (!pairs_.empty())
+      pairs_[placement.pair]->members++;
+  }
+  std::vector<std::thread> threads;
+  for (auto thread : range(GetThreadCount()))
+    threads.emplace_back(&NumaRunner::ThreadMain, this, thread, std::cref(inputs),
+                         nonce_start + iterations);
+  for (auto& thread : threads)
+    thread.join();
+
+  u64 solutions_after = 0;
+  for (auto& report : reports_)
+    solutions_after += report.solutions;
+  return solutions_after - solutions_before;
+}
+
+void NumaRunner::ThreadMain(u32 thread, const Inputs& inputs, u64 nonce_end) {
+  auto& placement = placements_[thread];
+  // Failures only make the placement worse, so they are ignored.
+  PinThreadToCpu(placement.cpu);
+  SetThreadMemoryNode(placement.node);
+  // The solver memory is mapped (or taken from the shared arena) in this
+  // thread, so it lands on the right node.
+  auto& solver = solvers_[thread];
+  if (!solver)
+    solver.reset(new Solver(pool_options_));
+  ThreadPair* pair = nullptr;
+  if (smt_mode_ != SmtMode::kIndependent) {
+    pair = pairs_[placement.pair].get();
+    solver->SetPhaseCallback([this, pair](Solver::Phase phase) {
+      EnterPhase(*pair, phase);
+    });
+  }
+
+  alignas(32) Inputs local_inputs = inputs;
+  u64 iterations = 0, solutions = 0;
+  ScopeTimer timer;
+  while (true) {
+    auto nonce = next_nonce_.fetch_add(1);
+    if (nonce >= nonce_end)
+      break;
+    local_inputs.SetSimpleNonce(nonce);
+    solver->Reset(local_inputs);
+    auto count = solver->Run();
+    if (count > 0)
+      solutions += (u64)count;
+    iterations++;
+  }
+  auto busy = timer.Micro();
+  if (pair) {
+    solver->SetPhaseCallback(nullptr);
+    LeavePair(*pair);
+  }
+
+  std::lock_guard<std::mutex> lock(reports_mutex_);
+  auto& report = reports_[placement.report];
+  report.iterations += iterations;
+  report.solutions += solutions;
+  report.busy_micro += busy;
+}
+
+void NumaRunner::EnterPhase(ThreadPair& pair, Solver::Phase phase) {
+  std::unique_lock<std::mutex> lock(pair.mutex);
+  if (smt_mode_ == SmtMode::kAligned) {
+    if (phase != Solver::Phase::kGeneration)
+      return;
+    // Wait for the partner (if it is still solving).
+    auto round = pair.round;
+    if (++pair.arrived >= pair.members) {
+      pair.arrived = 0;
+      pair.round++;
+      pair.changed.notify_all();
+    } else {
+      pair.changed.wait(lock, [&pair, round]() { return pair.round != round; });
+    }
+  } else {
+    if (phase == Solver::Phase::kGeneration) {
+      pair.changed.wait(lock, [&pair]() { return !pair.generating; });
+      pair.generating = true;
+    } else if (phase == Solver::Phase::kReduction) {
+      pair.generating = false;
+      pair.changed.notify_all();
+    }
+  }
+}
+
+void NumaRunner::LeavePair(ThreadPair& pair) {
+  std::lock_guard<std::mutex> lock(pair.mutex);
+  pair.members--;
+  // Don't let the partner wait for this thread.
+  if (pair.arrived > 0 && pair.arrived >= pair.members) {
+    pair.arrived = 0;
+    pair.round++;
+  }
+  pair.changed.notify_all();
+}
+
+PipelinedRunner::PipelinedRunner(const PoolOptions& pool_options)
+    : solver_(pool_options) {
+}
+
+u64 PipelinedRunner::Run(const Inputs& inputs, u64 nonce_start, u32 iterations) {
+  prepared_ = false;
+  buffer_free_ = true;
+  solver_.SetPhaseCallback([this](Solver::Phase phase) {
+    if (phase == Solver::Phase::kGeneratedStringsConsumed)
+      ReleaseBuffer();
+  });
+  std::thread generation(&PipelinedRunner::GenerationMain, this,
+                         std::cref(inputs), nonce_start, iterations);
+  u64 solutions = 0;
+  ScopeTimer timer;
+  for (auto iteration : range(iterations)) {
+    (void)iteration;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this]() { return prepared_; });
+      prepared_ = false;
+    }
+    timer.Reset();
+    auto count = solver_.RunPrepared();
+    // The buffer was released by the phase callback after step 0.
+    report_.reduction_micro += timer.Micro();
+    if (count > 0)
+      solutions += (u64)count;
+  }
+  generation.join();
+  solver_.SetPhaseCallback(nullptr);
+  report_.iterations += iterations;
+  report_.solutions += solutions;
+  return solutions;
+}
+
+void PipelinedRunner::GenerationMain(const Inputs& inputs, u64 nonce_start,
+                                     u32 iterations) {
+  alignas(32) Inputs local_inputs = inputs;
+  ScopeTimer timer;
+  for (auto iteration : range(iterations)) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this]() { return buffer_free_; });
+      buffer_free_ = false;
+    }
+    timer.Reset();
+    local_inputs.SetSimpleNonce(nonce_start + iteration);
+    solver_.PrepareNext(local_inputs);
+    report_.generation_micro += timer.Micro();
+    std::lock_guard<std::mutex> lock(mutex_);
+    prepared_ = true;
+    changed_.notify_all();
+  }
+}
+
+void PipelinedRunner::ReleaseBuffer() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  buffer_free_ = true;
+  changed_.notify_all();
+}
+
+SolverPool::SolverPool(u32 thread_count, const PoolOptions& pool_options)
+    : pool_options_(pool_options) {
+  if (thread_count == 0)
+    thread_count = NumaTopology::Get().GetCpuCount();
+  for (auto thread : range(thread_count)) {
+    (void)thread;
+    threads_.emplace_back(&SolverPool::ThreadMain, this);
+  }
+}
+
+SolverPool::~SolverPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    for (auto& job : unfinished_jobs_)
+      StopJob(*job.second);
+  }
+  work_cv_.notify_all();
+  for (auto& thread : threads_)
+    thread.join();
+  // Jobs nobody has started.
+  for (auto& job : unfinished_jobs_) {
+    if (job.second->on_done)
+      job.second->on_done(job.first, job.second->solutions);
+  }
+}
+
+u64 SolverPool::Submit(const Inputs& inputs, u64 nonce_start, u64 nonce_count,
+                       SolutionCallback on_solution, DoneCallback on_done,
+                       CancelCallback cancelled) {
+  std::shared_ptr<Job> job = std::make_shared<Job>();
+  job->inputs = inputs;
+  job->next_nonce = nonce_start;
+  job->nonce_end = nonce_count ? nonce_start + nonce_count : (u64)-1;
+  job->on_solution = on_solution;
+  job->on_done = on_done;
+  job->cancelled = cancelled;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  job->id = ++last_job_id_;
+  jobs_.push_back(job);
+  unfinished_jobs_[job->id] = job;
+  work_cv_.notify_all();
+  return job->id;
+}
+
+bool SolverPool::Cancel(u64 job_id) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto found = unfinished_jobs_.find(job_id);
+  if (found == unfinished_jobs_.end())
+    return false;
+  auto job = found->second;
+  StopJob(*job);
+  if (job->active_threads == 0) {
+    // Nobody works on the job, the last thread would end it otherwise.
+    jobs_.erase(std::find(jobs_.begin(), jobs_.end(), job));
+    unfinished_jobs_.erase(found);
+    lock.unlock();
+    if (job->on_done)
+      job->on_done(job->id, job->solutions);
+  }
+  return true;
+}
+
+u64 SolverPool::Sweep(const Inputs& inputs, u64 nonce_start, u64 nonce_count,
+                      SolutionCallback on_solution, CancelCallback cancelled) {
+  if (nonce_count == 0 && !cancelled) {
+    fprintf(stderr, "Sweep over unlimited nonces would never return.\n");
+    abort();
+  }
+  std::mutex mutex;
+  std::condition_variable done_cv;
+  bool done = false;
+  u64 result = 0;
+  Submit(inputs, nonce_start, nonce_count, on_solution,
+         [&](u64 job_id, u64 solutions) {
+           std::lock_guard<std::mutex> lock(mutex);
+           result = solutions;
+           done = true;
+           done_cv.notify_all();
+         },
+         cancelled);
+  std::unique_lock<std::mutex> lock(mutex);
+  done_cv.wait(lock, [&done]() { return done; });
+  return result;
+}
+
+void SolverPool::ThreadMain() {
+  // The solver memory is mapped (or taken from the shared arena) in this
+  // thread.
+  Solver solver(pool_options_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+    if (stopping_)
+      break;
+    auto job = jobs_.front();
+    job->active_threads++;
+    job->solvers.push_back(&solver);
+    lock.unlock();
+    Work(solver, *job);
+    lock.lock();
+    job->solvers.erase(
+        std::find(job->solvers.begin(), job->solvers.end(), &solver));
+    // The job has no more nonces for anybody, the last thread leaving it
+    // ends it.
+    if (!jobs_.empty() && jobs_.front() == job)
+      jobs_.pop_front();
+    if (--job->active_threads == 0) {
+      unfinished_jobs_.erase(job->id);
+      if (job->on_done) {
+        lock.unlock();
+        job->on_done(job->id, job->solutions);
+        lock.lock();
+      }
+    }
+  }
+}
+
+void SolverPool::StopJob(Job& job) {
+  job.finished.store(true, std::memory_order_relaxed);
+  for (auto solver : job.solvers)
+    solver->Stop();
+}
+
+void SolverPool::Work(Solver& solver, Job& job) {
+  alignas(32) Inputs inputs = job.inputs;
+  solver.SetSolutionCallback([&](const std::vector<u32>& solution) {
+    std::lock_guard<std::mutex> lock(job.callback_mutex);
+    if (job.finished.load(std::memory_order_relaxed))
+      return true;
+    job.solutions++;
+    if (job.on_solution(inputs, solution))
+      job.finished.store(true, std::memory_order_relaxed);
+    return job.finished.load(std::memory_order_relaxed);
+  });
+  // `Reset` clears a stop by `StopJob` coming just before it, so the solver
+  // checks the job state itself between steps too.
+  solver.SetStopCallback([&job]() {
+    if (!job.finished.load(std::memory_order_relaxed) && job.cancelled) {
+      std::lock_guard<std::mutex> lock(job.callback_mutex);
+      if (job.cancelled())
+        job.finished.store(true, std::memory_order_relaxed);
+    }
+    return job.finished.load(std::memory_order_relaxed);
+  });
+  while (!job.finished.load(std::memory_order_relaxed)) {
+    if (job.cancelled) {
+      std::lock_guard<std::mutex> lock(job.callback_mutex);
+      if (job.cancelled())
+        job.finished.store(true, std::memory_order_relaxed);
+    }
+    auto nonce = job.next_nonce.fetch_add(1);
+    if (job.finished.load(std::memory_order_relaxed) || nonce >= job.nonce_end)
+      break;
+    inputs.SetSimpleNonce(nonce);
+    solver.Reset(inputs);
+    solver.Run();
+  }
+  solver.SetSolutionCallback(nullptr);
+  solver.SetStopCallback(nullptr);
+}
+
+}  // namespace zceq_solver
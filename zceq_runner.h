@@ -0,0 +1,223 @@
+/* Copyright @ 2016 Pavel Moravec */
+#ifndef ZCEQ_RUNNER_H_
+#define ZCEQ_RUNNER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "zceq_solver.h"
+
+namespace zceq_solver {
+
+// Runs independent solvers (different nonces) in threads. Every thread is
+// pinned to one CPU, threads are spread over NUMA nodes round robin and
+// memory of each solver is placed on the node of its thread. On single
+// node systems, it is just a pool of pinned solver threads.
+class NumaRunner {
+ public:
+  // Placement of threads with respect to hyper-threading. In the paired
+  // modes, threads 2i and 2i+1 run on sibling CPUs of one physical core
+  // (or on the same CPU if the core has only one) and their phases are
+  // coordinated: `kAligned` starts string generation of both at the same
+  // time, `kStaggered` never lets them generate at the same time, so that
+  // the compute bound generation of one overlaps the memory bound
+  // reduction steps of the other.
+  enum class SmtMode { kIndependent, kAligned, kStaggered };
+  struct NodeReport {
+    i32 node = 0;
+    u32 threads = 0;
+    u64 iterations = 0;
+    u64 solutions = 0;
+    // Sum of solving times of all threads of the node.
+    u64 busy_micro = 0;
+  };
+
+  // `thread_count` == 0 means one thread per available CPU.
+  NumaRunner(u32 thread_count, const PoolOptions& pool_options,
+             SmtMode smt_mode = SmtMode::kIndependent);
+  NumaRunner(const NumaRunner&) = delete;
+
+  // Solves nonces `nonce_start` .. `nonce_start + iterations - 1` of
+  // `inputs`, returns total number of solutions. Solvers are kept for
+  // next runs. Reports are accumulated over runs.
+  u64 Run(const Inputs& inputs, u64 nonce_start, u32 iterations);
+
+  u32 GetThreadCount() {
+    return (u32)placements_.size();
+  }
+  const std::vector<NodeReport>& GetReport() {
+    return reports_;
+  }
+  void ResetReport();
+
+ protected:
+  struct Placement {
+    u32 cpu;
+    i32 node;
+    // Index to `reports_`.
+    u32 report;
+    // Index to `pairs_` (paired modes only).
+    u32 pair;
+  };
+  // Phase coordination of threads sharing a physical core.
+  struct ThreadPair {
+    std::mutex mutex;
+    std::condition_variable changed;
+    // Threads of the pair still solving.
+    u32 members = 0;
+    // `kAligned`: threads waiting for the partner to start generation.
+    u32 arrived = 0;
+    u64 round = 0;
+    // `kStaggered`: a thread of the pair is generating strings.
+    bool generating = false;
+  };
+
+  void ThreadMain(u32 thread, const Inputs& inputs, u64 nonce_end);
+  void EnterPhase(ThreadPair& pair, Solver::Phase phase);
+  void LeavePair(ThreadPair& pair);
+
+  PoolOptions pool_options_;
+  SmtMode smt_mode_;
+  std::vector<Placement> placements_;
+  std::vector<std::unique_ptr<ThreadPair>> pairs_;
+  std::vector<std::unique_ptr<Solver>> solvers_;
+  std::vector<NodeReport> reports_;
+  std::mutex reports_mutex_;
+  std::atomic<u64> next_nonce_;
+};
+
+// Two-stage pipeline over consecutive nonces of one solver: a generation
+// thread produces strings of nonce n+1 (compute bound Blake2b) while the
+// solver thread runs the reduction steps of nonce n (memory bound).
+class PipelinedRunner {
+ public:
+  struct Report {
+    u64 iterations = 0;
+    u64 solutions = 0;
+    // Busy times of the generation and the solver thread.
+    u64 generation_micro = 0;
+    u64 reduction_micro = 0;
+  };
+
+  explicit PipelinedRunner(const PoolOptions& pool_options = PoolOptions());
+  PipelinedRunner(const PipelinedRunner&) = delete;
+
+  // Solves nonces `nonce_start` .. `nonce_start + iterations - 1` of
+  // `inputs`, returns total number of solutions.
+  u64 Run(const Inputs& inputs, u64 nonce_start, u32 iterations);
+
+  const Report& GetReport() {
+    return report_;
+  }
+  void ResetReport() {
+    report_ = Report();
+  }
+
+ protected:
+  void GenerationMain(const Inputs& inputs, u64 nonce_start, u32 iterations);
+  void ReleaseBuffer();
+
+  Solver solver_;
+  Report report_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  // The prepared buffer holds strings not reduced yet.
+  bool prepared_ = false;
+  // The prepared buffer can be overwritten.
+  bool buffer_free_ = true;
+};
+
+// Persistent pool of solver threads for library users. Each thread owns
+// a long-lived solver (created in the thread, so its memory is local to
+// it), the threads sleep between jobs. A job is a sweep over nonces of
+// one input; all threads take nonces from a shared counter. Unlike
+// `NumaRunner`, threads are not pinned since they live in a host process.
+class SolverPool {
+ public:
+  // Called for each solution with the input (nonce included) it belongs
+  // to, calls are serialized per job. Returning true ends the job.
+  using SolutionCallback =
+      std::function<bool(const Inputs& inputs, const std::vector<u32>& solution)>;
+  // Polled before each nonce and between reduction steps (serialized per
+  // job), true ends the job within a step.
+  using CancelCallback = std::function<bool()>;
+  // Called once when a job ends, with number of solutions passed to its
+  // `on_solution`.
+  using DoneCallback = std::function<void(u64 job_id, u64 solutions)>;
+
+  // `thread_count` == 0 means one thread per available CPU.
+  explicit SolverPool(u32 thread_count, const PoolOptions& pool_options = PoolOptions());
+  SolverPool(const SolverPool&) = delete;
+  // Cancels all jobs, their `on_done` are called before it returns.
+  ~SolverPool();
+
+  // Queues solving of nonces `nonce_start` .. `nonce_start + nonce_count - 1`
+  // of `inputs` (`nonce_count` == 0 means no limit) until the range is
+  // exhausted or a callback ends the job. Jobs are processed in order of
+  // submission. Returns immediately with id of the job. Callbacks are
+  // called from the pool threads (`on_done` possibly even before `Submit`
+  // returns, or from `Cancel`).
+  u64 Submit(const Inputs& inputs, u64 nonce_start, u64 nonce_count,
+             SolutionCallback on_solution, DoneCallback on_done = nullptr,
+             CancelCallback cancelled = nullptr);
+  // Ends the job. A job waiting in the queue is dropped at once, solvers
+  // working on the job are stopped at their next reduction step.
+  // Returns false when the job is not known (e.g. it has ended already).
+  bool Cancel(u64 job_id);
+  // Submits a job and waits for its end. Returns number of solutions
+  // passed to `on_solution`. Unlimited `nonce_count` needs `cancelled`.
+  u64 Sweep(const Inputs& inputs, u64 nonce_start, u64 nonce_count,
+            SolutionCallback on_solution, CancelCallback cancelled = nullptr);
+
+  u32 GetThreadCount() {
+    return (u32)threads_.size();
+  }
+
+ protected:
+  struct Job {
+    u64 id;
+    // Copied to an aligned local before solving, make_shared doesn't
+    // honour extended alignment.
+    Inputs inputs;
+    std::atomic<u64> next_nonce;
+    u64 nonce_end;
+    SolutionCallback on_solution;
+    DoneCallback on_done;
+    CancelCallback cancelled;
+    // Serializes the callbacks.
+    std::mutex callback_mutex;
+    std::atomic<bool> finished{false};
+    u64 solutions = 0;
+    // Threads working on the job and their solvers, guarded by `mutex_`.
+    u32 active_threads = 0;
+    std::vector<Solver*> solvers;
+  };
+
+  void ThreadMain();
+  void Work(Solver& solver, Job& job);
+  // Marks the job finished and stops its solvers, `mutex_` must be held.
+  void StopJob(Job& job);
+
+  PoolOptions pool_options_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  // Signals a new job or stopping to the threads.
+  std::condition_variable work_cv_;
+  // Jobs with nonces left in order of submission, threads take the first.
+  std::deque<std::shared_ptr<Job>> jobs_;
+  // All jobs which have not ended, by id.
+  std::map<u64, std::shared_ptr<Job>> unfinished_jobs_;
+  u64 last_job_id_ = 0;
+  bool stopping_ = false;
+};
+
+}  // namespace zceq_solver
+
+#endif  // ZCEQ_RUNNER_H_
@@ -1,7 +1,9 @@
 /* Copyright @ 2016 Pavel Moravec */
 #include <algorithm>
 #include <functional>
+#include <new>
 #include <chrono>
+#include <thread>
 
 #include "zceq_solver.h"
 
@@ -13,33 +15,68 @@ void ExpandArrayFast(const u8* hash, u8* array);
 void ReorderBitsInHash(const u8* __restrict hash,
                               u8* __restrict array);
 
-Solver::Solver() : allocator_(Const::kMaximumStringSetSize,
-                              // Manually found minimal values
-                              (Const::kExpandHashes
-                               ? Const::kMemoryForExpandedProblem
-                               : Const::kMemoryForNonExpandedProblem),
-                              Const::kReportMemoryAllocation) {
+static inline u64 now() {
+  return (u64)std::chrono::steady_clock::now()
+      .time_since_epoch().count() / 1000;
+}
+
+Solver::Solver() : verifier_(blake),
+                   allocator_(Const::kMaximumStringSetSize,
+                              GetMemorySlotCount(),
+                              Const::kReportMemoryAllocation,
+                              sizeof(Workspace),
+                              Const::kSpaceColoring,
+                              Const::kSpaceColors) {
   ResetTimer();
-  context_ = new Context();
+  solution_objects_.reserve(Const::kPreallocatedSolutions);
+  for (auto i : range(Const::kPreallocatedSolutions)) {
+    (void)i;
+    solution_objects_.emplace_back(Const::kSolutionSize);
+  }
+  if (Const::kProcessSolutionCandidatesInThread) {
+    candidate_ring_.reset(
+        new SPSCRing<SolutionCandidate, Const::kSolutionCandidateRingSize>());
+    candidate_team_.reset(new ThreadTeam(2));
+  }
+}
+
+Solver::Solver(const PoolOptions& pool_options) : Solver() {
+  allocator_.MapPool(pool_options);
 }
 
 Solver::~Solver() {
-  delete context_;
+}
+
+Workspace* Solver::GetWorkspace() {
+  if (workspace_ == nullptr) {
+    // Zeroed, the final step engine relies on unused hash table slots.
+    workspace_ = new (allocator_.GetFixedArea()) Workspace();
+  }
+  return workspace_;
+}
+
+void Solver::SetStepThreads(u32 count) {
+  if (std::max(count, 1u) == GetStepThreads())
+    return;
+  step_team_.reset();
+  step_workers_.clear();
+  if (count <= 1)
+    return;
+  for (auto i : range(count)) {
+    (void)i;
+    step_workers_.emplace_back(new StepWorker());
+  }
+  step_team_.reset(new ThreadTeam(count));
 }
 
 void Solver::Reset(Inputs& inputs) {
   Reset(inputs.data, sizeof inputs.data);
 }
 
-void Solver::Reset(const u8* data, u64 length) {
-  assert(data != nullptr);
-  assert(length == 140);
-  ResetTimer();
-  ResetMemoryAllocator();
-  ClearSolutions();
-
+// Blake2b needs the header data 32B-aligned, copy them if they are not.
+static void PrecomputeAligned(Blake2b& blake, const u8* data, u64 length) {
   auto address = (u64)data;
-  bool aligned = (address & ~31) == 0;
+  bool aligned = (address & 31) == 0;
   if (aligned) {
     blake.Precompute(data, length);
   } else {
@@ -47,6 +84,31 @@ void Solver::Reset(const u8* data, u64 length) {
     memcpy(aligned_copy, data, 140);
     blake.Precompute(aligned_copy, length);
   }
+}
+
+void Solver::Reset(const u8* data, u64 length) {
+  assert(data != nullptr);
+  assert(length == 140);
+  ResetTimer();
+  // Spaces are placed by the same plan in every run, `ApplyMemoryPlan`
+  // moves them from the last stage back to the first one. So they are
+  // created only once.
+  if (space_X1 == nullptr)
+    ResetMemoryAllocator();
+  ClearSolutions();
+
+  PrecomputeAligned(blake, data, length);
+  initialized_ = true;
+}
+
+void Verifier::Reset(Inputs& inputs) {
+  Reset(inputs.data, sizeof inputs.data);
+}
+
+void Verifier::Reset(const u8* data, u64 length) {
+  assert(data != nullptr);
+  assert(length == 140);
+  PrecomputeAligned(blake, data, length);
   initialized_ = true;
 }
 
@@ -58,12 +120,12 @@ void Solver::ResetMemoryAllocator() {
   // One link index for each reduced segment (all - 1).
   // One basic index for initial sort before first collision search.
   link_indices_.resize(Const::kTotalSegmentsCount);
-  int name_number = 0;
-  for (auto& link_index : link_indices_) {
-    std::string index_name = "I";
-    index_name += std::to_string(name_number++);
-    link_index = allocator_.CreateSpace<PairLink>(index_name, 0);
-  }
+  static const char* const kIndexNames[] = {
+      "I0", "I1", "I2", "I3", "I4", "I5", "I6", "I7", "I8", "I9"};
+  static_assert(sizeof kIndexNames / sizeof kIndexNames[0] >= Const::kTotalSegmentsCount, "");
+  u32 name_number = 0;
+  for (auto& link_index : link_indices_)
+    link_index = allocator_.CreateSpace<PairLink>(kIndexNames[name_number++], 0);
 }
 
 static u32 GetTestSegmentValue(int i, int s, Random& r) {
@@ -78,11 +140,11 @@ static u32 GetTestSegmentValue(int i, int s, Random& r) {
   }
 }
 
-void Solver::GenerateOTString(u32 index, OneTimeString& result)
+void SolutionVerifier::GenerateOTString(u32 index, OneTimeString& result)
 {
   constexpr i32 half_hash_length = Const::N_parameter / 8;
   alignas(32) State blake_result;
-  blake.FinalizeInto(blake_result, index / 2);
+  blake_.FinalizeInto(blake_result, index / 2);
 
   auto relevant_part = &blake_result.hash[(index % 2) * half_hash_length];
 
@@ -93,7 +155,7 @@ void Solver::GenerateOTString(u32 index, OneTimeString& result)
   result.SetIndex(index);
 }
 
-void Solver::GenerateOTStringTest(u32 index, OneTimeString& result)
+void SolutionVerifier::GenerateOTStringTest(u32 index, OneTimeString& result)
 {
   Random r;
   result.SetIndex(index);
@@ -117,10 +179,8 @@ static inline u64 ComputeBucketFromHash(void* hash_beginning) {
 }
 
 Random r;
-void Solver::GenerateXStringsTest(
-    SpaceAllocator::Space* target_space, BucketIndices* buckets) {
+void Solver::GenerateXStringsTest(GeneratedString* output, BucketIndices* buckets) {
 //  r.InitializeState(2312044234393,30498329312);
-  GeneratedString* output = target_space->As<GeneratedString>();
 
   OneTimeString temp;
   for (auto i : range(Const::kSolutionSize * Const::kTestSetExpandMultiplier)) {
@@ -149,10 +209,8 @@ void Solver::GenerateXStringsTest(
   }
 }
 
-void Solver::GenerateXStrings(
-    SpaceAllocator::Space* target_space, BucketIndices* buckets) {
-
-  GeneratedString* output = target_space->As<GeneratedString>();
+void Solver::GenerateXStrings(Blake2b& blake, GeneratedString* output,
+                              BucketIndices* buckets) {
 
   constexpr i32 half_hash_length = Const::N_parameter / 8;
   constexpr auto bytes_skipped = GeneratedString::bytes_skipped;
@@ -189,10 +247,8 @@ void Solver::GenerateXStrings(
 }
 
 template<u32 batch_size>
-void Solver::GenerateXStringsBatch(
-    SpaceAllocator::Space* target_space, BucketIndices* buckets) {
-
-  GeneratedString* output = target_space->As<GeneratedString>();
+void Solver::GenerateXStringsBatch(Blake2b& blake, GeneratedString* output,
+                                   BucketIndices* buckets) {
   // Double check everything works fine.
   assert(batch_size == blake.GetBatchSize());
 
@@ -248,6 +304,10 @@ template<typename C, typename S>
 bool ReductionStep<C,S>::Execute(Context* context,
                                  BucketIndices* in_buckets,
                                  BucketIndices* out_buckets) noexcept {
+  if (C::isFinal && Const::kUseFinalStepEngine)
+    return ExecuteFinal(context, in_buckets, out_buckets);
+
+  auto start = now();
   PrepareRTConfiguration();
 
   if (Const::kReportCollisions) {
@@ -256,11 +316,6 @@ bool ReductionStep<C,S>::Execute(Context* context,
     collisions_.resize(Const::kTooManyBasicCollisions + 2);
   }
 
-  auto hash = context->hash.data();
-  auto count = context->count.data();
-  auto cum_sum = context->cum_sum.data();
-  auto collisions = context->collisions.data();
-
   if (C::isFinal)
     // In the last step, we don't have to reset all parts of output buckets,
     // because only one bucket is used for solution candidates.
@@ -277,196 +332,408 @@ bool ReductionStep<C,S>::Execute(Context* context,
   // which are not determined by a bucket number. Second, we need to copy pair links
   // into a separate data structure. It can be done during the same iteration over
   // the input strings.
-  for (u32 outer_partition : range(Const::kPartitionCount)) {
-  for (u32 _bucket : range(Const::kBucketsPerPartition)) {
-
-    const auto in_bucket = _bucket + outer_partition * Const::kBucketsPerPartition;
-    auto base_index = in_bucket * Const::kItemsInBucket;
-    const InString* const in_rows = &in_strings_[base_index];
-    PairLink* pair_index = &target_pair_index_[base_index];
-    assert(in_buckets->counter[in_bucket] >= base_index);
-    assert(in_buckets->counter[in_bucket] - base_index <=
-           Const::kItemsInBucket);
-
-    // Each bucket has fresh new version of a lookup table.
-    memset(count, 0x00, Const::kHashTableSize * sizeof *count);
-
-    int i = 0;
-    int cnt;
-    // Since each bucket can have strings separated into partition, we must skip
-    // the not-used parts of the buckets (there are not valid strings there).
-    for (u32 inner_partition : range(Const::kPartitionCount)) {
-      int actual_items = in_buckets->partition_sizes[in_bucket][inner_partition];
-      auto ProcessOneRow = [&]() {
-        auto idx = Const::kHashTableMask &
-                   (in_rows[i].GetFirstSegmentRaw() >> Const::kBucketCountBits);
-        if (InString::segments_reduced < Const::kUseTemporaryHashArrayBeforeStep)
-          hash[i] = idx;
-        count[idx]++;
-        // We don't have to store the last index, because the source strings will
-        // not be destroyed when we find a collision. So we can read the links
-        // directly from the strings (We have to read the strings anyway so other
-        // memory lookups would be a plain overhead).
-        if (!C::isFinal && !Const::kStoreIndicesEarly)
-          OutputIndex(&pair_index[i], in_rows[i].GetLink());
-        i++;
-      };
-      cnt = actual_items / 4;
-      while (LIKELY(cnt--)) {
-        ProcessOneRow();
-        ProcessOneRow();
-        ProcessOneRow();
-        ProcessOneRow();
-      }
-      cnt = 0;
-      while (cnt < (actual_items % 4)) {
-        ProcessOneRow();
-        cnt++;
+  auto threads = (u32)solver_.step_workers_.size();
+  if (C::isFinal || Const::kReportCollisions || threads <= 1) {
+    DirectOutput output{out_buckets->counter};
+    for (u32 outer_partition : range(Const::kPartitionCount)) {
+      for (u32 _bucket : range(Const::kBucketsPerPartition)) {
+        // The solution callback doesn't need more solutions.
+        if (C::isFinal && UNLIKELY(solver_.IsStopped()))
+          break;
+        ProcessBucket(context, in_buckets, out_buckets,
+                      _bucket + outer_partition * Const::kBucketsPerPartition, output);
+        out_buckets->CheckCounters();
       }
-      // Move to the next input partition - skip the unused strings.
-      i += (Const::kItemsInOutPartition - actual_items);
+      // The last step doesn't produce proper partitions, so don't touch it.
+      // TODO: This should be extracted into separate step.
+      if (!C::isFinal)
+        out_buckets->ClosePartition(outer_partition);
     }
-
-    // Compute cummulative sum, eliminate groups greater then Const::kTooManyBasicCollisions - 1
-    // We start from 1, because value 0 is used to mark not-used key. The index 0
-    // is then used for writing 'trash' data somewhere during branch-less writes.
-    u16 sum = 1;
-    i = 0;
-    auto ProcessOneHash = [&]() {
-      const auto count_i = count[i];
-      const auto valid = (count_i >= 2 && count_i < Const::kTooManyBasicCollisions);
-      cum_sum[i] = valid ? sum : (u16) 0;
-      sum += valid ? count_i : 0;
-      i++;
-      if (Const::kReportCollisions) {
-        if (count_i > Const::kTooManyBasicCollisions) {
-          collisions_[Const::kTooManyBasicCollisions]++;
-          collisions_[Const::kTooManyBasicCollisions + 1] += count_i;
-        } else if (count_i >= 2) {
-          collisions_[count_i]++;
+  } else {
+    // Strings are written by more threads into the same buckets, the XOR
+    // must not write behind a string into a chunk of another thread.
+    static_assert(Const::kXORAlignment <= Const::kXStringAlignment &&
+                  sizeof(PairLink) % Const::kXORAlignment == 0, "");
+    // Threads take input buckets of the partition one by one. All output
+    // strings of a partition must be written before the first thread
+    // closes the partition, and the others may start the next partition
+    // only after that.
+    auto& workers = solver_.step_workers_;
+    auto& team = *solver_.step_team_;
+    std::atomic<u32> next_bucket{0};
+    team.Run([&](u32 thread) {
+      auto worker = workers[thread].get();
+      for (u32 outer_partition : range(Const::kPartitionCount)) {
+        worker->output.Reset(out_buckets->counter);
+        u32 bucket;
+        while ((bucket = next_bucket.fetch_add(1, std::memory_order_relaxed))
+               < Const::kBucketsPerPartition) {
+          ProcessBucket(&worker->context, in_buckets, out_buckets,
+                        bucket + outer_partition * Const::kBucketsPerPartition,
+                        worker->output);
         }
+        team.Barrier();
+        if (thread == 0) {
+          CloseSharedPartition(outer_partition, out_buckets);
+          next_bucket.store(0, std::memory_order_relaxed);
+        }
+        team.Barrier();
       }
+    });
+  }
+
+  RecordStats(in_buckets, out_buckets, start);
+  solver_.ReportStep("Performed reduction step");
+  if (Const::kReportCollisions)
+    ReportCollisionStructure(collisions_, in_buckets->CountUsedPositions());
+
+  return true;
+}
+
+template<typename C, typename S>
+template<typename Output>
+void ReductionStep<C,S>::ProcessBucket(Context* context,
+                                       BucketIndices* in_buckets,
+                                       BucketIndices* out_buckets,
+                                       u32 in_bucket, Output& output) {
+  auto hash = context->hash;
+  auto count = context->count;
+  auto cum_sum = context->cum_sum;
+  auto collisions = context->collisions;
+
+  auto base_index = in_bucket * Const::kBucketStride;
+  const InString* const in_rows = &in_strings_[base_index];
+  PairLink* pair_index = &target_pair_index_[base_index];
+  assert(in_buckets->counter[in_bucket] >= base_index);
+  assert(in_buckets->counter[in_bucket] - base_index <=
+         Const::kItemsInBucket);
+
+  // Each bucket has fresh new version of a lookup table.
+  memset(count, 0x00, Const::kHashTableSize * sizeof *count);
+
+  int i = 0;
+  int cnt;
+  // Since each bucket can have strings separated into partition, we must skip
+  // the not-used parts of the buckets (there are not valid strings there).
+  for (u32 inner_partition : range(Const::kPartitionCount)) {
+    int actual_items = in_buckets->partition_sizes[in_bucket][inner_partition];
+    auto ProcessOneRow = [&]() {
+      auto idx = Const::kHashTableMask &
+                 (in_rows[i].GetFirstSegmentRaw() >> Const::kBucketCountBits);
+      if (InString::segments_reduced < Const::kUseTemporaryHashArrayBeforeStep)
+        hash[i] = idx;
+      count[idx]++;
+      // We don't have to store the last index, because the source strings will
+      // not be destroyed when we find a collision. So we can read the links
+      // directly from the strings (We have to read the strings anyway so other
+      // memory lookups would be a plain overhead).
+      if (!C::isFinal && !Const::kStoreIndicesEarly)
+        OutputIndex(&pair_index[i], in_rows[i].GetLink());
+      i++;
     };
-    static_assert(Const::kHashTableSize % 8 == 0, "");
-    cnt = Const::kHashTableSize / 4;
-    // The compiler should probably do the unroll itself, but it sometimes
-    // does not.
+    cnt = actual_items / 4;
     while (LIKELY(cnt--)) {
-      ProcessOneHash();
-      ProcessOneHash();
-      ProcessOneHash();
-      ProcessOneHash();
+      ProcessOneRow();
+      ProcessOneRow();
+      ProcessOneRow();
+      ProcessOneRow();
+    }
+    cnt = 0;
+    while (cnt < (actual_items % 4)) {
+      ProcessOneRow();
+      cnt++;
     }
+    // Move to the next input partition - skip the unused strings.
+    i += (Const::kItemsInOutPartition - actual_items);
+  }
 
-    // Fill 'collisions' array with proper string indices to form a collision
-    // groups within the array - all colliding indices are together in the array.
-    i = 0;
-    for (u32 inner_partition : range(Const::kPartitionCount)) {
-      int actual_items = in_buckets->partition_sizes[in_bucket][inner_partition];
-      auto FillOneItem = [&]() {
-        u16 idx;
-        if (InString::segments_reduced < Const::kUseTemporaryHashArrayBeforeStep)
-          idx = hash[i];
-        else
-          idx = Const::kHashTableMask &
-              (in_rows[i].GetFirstSegmentRaw() >> Const::kBucketCountBits);
-        // Use branch-less version of code. We always rewrite collisions[0]
-        // when the i-th string is not part of any valid collision
-        // (cum_sum[hash[i]] == 0). But the collisions[0] is therefore always hot
-        // (in L1) so it is not an issue and it allows to increment without branch
-        // (hopefully and probably a conditional move is generated by a compiler).
-        collisions[cum_sum[idx]] = (u16) i;
-        cum_sum[idx] += (cum_sum[idx] > 0);
-        i++;
-      };
-      cnt = actual_items / 4;
-      while (LIKELY(cnt--)) {
-        FillOneItem();
-        FillOneItem();
-        FillOneItem();
-        FillOneItem();
+  // Compute cummulative sum, eliminate groups greater then Const::kTooManyBasicCollisions - 1
+  // We start from 1, because value 0 is used to mark not-used key. The index 0
+  // is then used for writing 'trash' data somewhere during branch-less writes.
+  u16 sum = 1;
+  i = 0;
+  auto ProcessOneHash = [&]() {
+    const auto count_i = count[i];
+    const auto valid = (count_i >= 2 && count_i < Const::kTooManyBasicCollisions);
+    cum_sum[i] = valid ? sum : (u16) 0;
+    sum += valid ? count_i : 0;
+    i++;
+    if (Const::kReportCollisions) {
+      if (count_i > Const::kTooManyBasicCollisions) {
+        collisions_[Const::kTooManyBasicCollisions]++;
+        collisions_[Const::kTooManyBasicCollisions + 1] += count_i;
+      } else if (count_i >= 2) {
+        collisions_[count_i]++;
       }
-      cnt = actual_items % 4;
-      while (LIKELY(cnt--)) {
-        FillOneItem();
+    }
+  };
+  static_assert(Const::kHashTableSize % 8 == 0, "");
+  cnt = Const::kHashTableSize / 4;
+  // The compiler should probably do the unroll itself, but it sometimes
+  // does not.
+  while (LIKELY(cnt--)) {
+    ProcessOneHash();
+    ProcessOneHash();
+    ProcessOneHash();
+    ProcessOneHash();
+  }
+
+  // Fill 'collisions' array with proper string indices to form a collision
+  // groups within the array - all colliding indices are together in the array.
+  i = 0;
+  for (u32 inner_partition : range(Const::kPartitionCount)) {
+    int actual_items = in_buckets->partition_sizes[in_bucket][inner_partition];
+    auto FillOneItem = [&]() {
+      u16 idx;
+      if (InString::segments_reduced < Const::kUseTemporaryHashArrayBeforeStep)
+        idx = hash[i];
+      else
+        idx = Const::kHashTableMask &
+            (in_rows[i].GetFirstSegmentRaw() >> Const::kBucketCountBits);
+      // Use branch-less version of code. We always rewrite collisions[0]
+      // when the i-th string is not part of any valid collision
+      // (cum_sum[hash[i]] == 0). But the collisions[0] is therefore always hot
+      // (in L1) so it is not an issue and it allows to increment without branch
+      // (hopefully and probably a conditional move is generated by a compiler).
+      collisions[cum_sum[idx]] = (u16) i;
+      cum_sum[idx] += (cum_sum[idx] > 0);
+      i++;
+    };
+    cnt = actual_items / 4;
+    while (LIKELY(cnt--)) {
+      FillOneItem();
+      FillOneItem();
+      FillOneItem();
+      FillOneItem();
+    }
+    cnt = actual_items % 4;
+    while (LIKELY(cnt--)) {
+      FillOneItem();
+    }
+    // Move to the next input partition
+    i += (Const::kItemsInOutPartition - actual_items);
+  }
+  const InString* collision_group[Const::kTooManyBasicCollisions];
+
+  for (auto i : range(Const::kHashTableSize)) {
+    if (!cum_sum[i]) {
+      continue;
+    }
+    auto cg_indices = &collisions[cum_sum[i] - count[i]];
+    auto cnt = count[i];
+    u16* prefetch_ptr = cg_indices + Const::kPrefetchDistance;
+
+    #define ProduceOutput(a,b,c,d) (C::isFinal ? \
+       GenerateSolution(a,b,c,d, out_buckets->counter) : \
+       OutputString(a,b,c,d, output, in_bucket))
+
+    // Implement the most probable cases (collision group size <= 4) unrolled.
+    // If the group size is larger, handle only the long cycles in 'default'
+    // branch and then follow by unrolled implementation. We aware that unrolling
+    // too can hurt the performance.
+    switch (cnt) {
+      default: {
+        collision_group[0] = in_rows + cg_indices[0];
+        collision_group[1] = in_rows + cg_indices[1];
+        collision_group[2] = in_rows + cg_indices[2];
+        collision_group[3] = in_rows + cg_indices[3];
+        for (auto ii = 4; ii < cnt; ii++) {
+          collision_group[ii] = in_rows + cg_indices[ii];
+          if (Const::kPrefetchDistance > 0)
+            __builtin_prefetch(in_rows + *prefetch_ptr++);
+          for (auto ii2 = 0; ii2 < ii; ii2++) {
+            ProduceOutput(collision_group[ii2], collision_group[ii], cg_indices[ii2], cg_indices[ii]);
+          }
+        }
       }
-      // Move to the next input partition
-      i += (Const::kItemsInOutPartition - actual_items);
+      case 4:
+        if (Const::kPrefetchDistance > 0)
+          __builtin_prefetch(in_rows + *prefetch_ptr++);
+        ProduceOutput(in_rows + cg_indices[0], in_rows + cg_indices[3], cg_indices[0], cg_indices[3]);
+        ProduceOutput(in_rows + cg_indices[1], in_rows + cg_indices[3], cg_indices[1], cg_indices[3]);
+        ProduceOutput(in_rows + cg_indices[2], in_rows + cg_indices[3], cg_indices[2], cg_indices[3]);
+      case 3:
+        if (Const::kPrefetchDistance > 0)
+          __builtin_prefetch(in_rows + *prefetch_ptr++);
+        ProduceOutput(in_rows + cg_indices[0], in_rows + cg_indices[2], cg_indices[0], cg_indices[2]);
+        ProduceOutput(in_rows + cg_indices[1], in_rows + cg_indices[2], cg_indices[1], cg_indices[2]);
+      case 2:
+        if (Const::kPrefetchDistance > 0)
+          __builtin_prefetch(in_rows + *prefetch_ptr++);
+        ProduceOutput(in_rows + cg_indices[0], in_rows + cg_indices[1], cg_indices[0], cg_indices[1]);
+      case 1:
+      case 0:
+        break;
     }
-    const InString* collision_group[Const::kTooManyBasicCollisions];
+    #undef ProduceOutput
+  }
+}
 
-    for (auto i : range(Const::kHashTableSize)) {
-      if (!cum_sum[i]) {
+template<typename C, typename S>
+void ReductionStep<C,S>::CloseSharedPartition(u32 partition, BucketIndices* out_buckets) {
+  struct Hole {
+    u32 begin;
+    u32 end;
+  };
+  auto& workers = solver_.step_workers_;
+  std::vector<Hole> holes;
+  holes.reserve(workers.size());
+
+  for (auto bucket : range(Const::kBucketCount)) {
+    holes.clear();
+    for (auto& worker : workers) {
+      auto& output = worker->output;
+      if (output.next[bucket] != output.end[bucket])
+        holes.push_back({output.next[bucket], output.end[bucket]});
+    }
+    // The shared counter can get behind the end of the bucket when the
+    // bucket is full.
+    auto& counter = out_buckets->counter[bucket];
+    auto last = std::min(counter, Const::kBucketStride * bucket + Const::kItemsInBucket);
+    std::sort(holes.begin(), holes.end(),
+              [](const Hole& a, const Hole& b) { return a.begin < b.begin; });
+
+    // Fill the holes from the lowest one by strings taken from the end of
+    // the used positions. Strings stay within the bucket and partition of
+    // their source strings, so their links are translated the same way.
+    u32 first = 0;
+    u32 count = (u32)holes.size();
+    while (first < count) {
+      auto& last_hole = holes[count - 1];
+      if (last_hole.end >= last) {
+        // The highest hole has no strings behind it.
+        last = std::min(last, last_hole.begin);
+        count--;
         continue;
       }
-      auto cg_indices = &collisions[cum_sum[i] - count[i]];
-      auto cnt = count[i];
-      u16* prefetch_ptr = cg_indices + Const::kPrefetchDistance;
-
-      #define ProduceOutput(a,b,c,d) (C::isFinal ? \
-         GenerateSolution(a,b,c,d, out_buckets->counter) : \
-         OutputString(a,b,c,d, out_buckets->counter, in_bucket))
-
-      // Implement the most probable cases (collision group size <= 4) unrolled.
-      // If the group size is larger, handle only the long cycles in 'default'
-      // branch and then follow by unrolled implementation. We aware that unrolling
-      // too can hurt the performance.
-      switch (cnt) {
-        default: {
-          collision_group[0] = in_rows + cg_indices[0];
-          collision_group[1] = in_rows + cg_indices[1];
-          collision_group[2] = in_rows + cg_indices[2];
-          collision_group[3] = in_rows + cg_indices[3];
-          for (auto ii = 4; ii < cnt; ii++) {
-            collision_group[ii] = in_rows + cg_indices[ii];
-            if (Const::kPrefetchDistance > 0)
-              __builtin_prefetch(in_rows + *prefetch_ptr++);
-            for (auto ii2 = 0; ii2 < ii; ii2++) {
-              ProduceOutput(collision_group[ii2], collision_group[ii], cg_indices[ii2], cg_indices[ii]);
-            }
+      auto& hole = holes[first];
+      out_strings_[hole.begin++] = out_strings_[--last];
+      if (hole.begin == hole.end)
+        first++;
+    }
+    counter = last;
+  }
+  out_buckets->ClosePartition(partition);
+}
+
+template<typename C, typename S>
+bool ReductionStep<C,S>::ExecuteFinal(Context* context,
+                                      BucketIndices* in_buckets,
+                                      BucketIndices* out_buckets) noexcept {
+  assert(C::isFinal);
+  static_assert(Const::kItemsInBucket < 0xffff, "Positions + 1 must fit into u16");
+  auto start = now();
+  PrepareRTConfiguration();
+
+  // Strings of one bucket are chained by hash table slots addressed by
+  // the remaining bits above bucket bits. The table has about twice as
+  // many slots as strings in a bucket and it is not cleared for each bucket,
+  // slots are valid only if marked by current bucket's stamp. Value 0
+  // terminates a chain, so positions are stored increased by 1.
+  auto workspace = solver_.GetWorkspace();
+  auto heads = workspace->final_heads;
+  auto next = context->collisions;
+
+  // Only one bucket is used for solution candidates.
+  out_buckets->ResetForFinal();
+
+  for (u32 in_bucket : range(Const::kBucketCount)) {
+    // The solution callback doesn't need more solutions.
+    if (UNLIKELY(solver_.IsStopped()))
+      break;
+    auto base_index = in_bucket * Const::kBucketStride;
+    const InString* const in_rows = &in_strings_[base_index];
+
+    if (UNLIKELY(++workspace->final_stamp == 0)) {
+      memset(heads, 0x00, Const::kFinalTableSize * sizeof *heads);
+      workspace->final_stamp = 1;
+    }
+    const u32 stamp = (u32)workspace->final_stamp << 16;
+    final_pairs_.clear();
+
+    // Single pass over the strings. Each string is compared on all
+    // remaining bits with the previous strings in its chain (2 on
+    // average), matches are rare.
+    u16 i = 0;
+    for (u32 inner_partition : range(Const::kPartitionCount)) {
+      int actual_items = in_buckets->partition_sizes[in_bucket][inner_partition];
+      for (u16 end = i + actual_items; i < end; i++) {
+        const auto key = in_rows[i].GetFinalCollisionSegments();
+        const auto idx = Const::kFinalTableMask & (key >> Const::kBucketCountBits);
+        const auto head = heads[idx];
+        const u16 chain = ((head & 0xffff0000) == stamp) ? (u16)head : (u16)0;
+        next[i] = chain;
+        heads[idx] = stamp | (i + 1u);
+        if (LIKELY(!chain))
+          continue;
+
+        u32 equal = 0;
+        u16 first = 0;
+        for (auto j = chain; j; j = next[j - 1]) {
+          if (in_rows[j - 1].GetFinalCollisionSegments() == key) {
+            equal++;
+            first = j - 1;
+          }
+        }
+        if (LIKELY(!equal))
+          continue;
+
+        if (equal + 1 >= Const::kTooManyFinalCollisions) {
+          // Too many strings with the same bits, drop the whole group.
+          for (auto& pair : final_pairs_)
+            if (pair.key == key)
+              pair.eliminated = true;
+        } else if (Const::kStep8FilterByLastSegment) {
+          // A string with the same remaining bits is hardly produced by
+          // different source strings, one candidate per group is enough.
+          if (equal == 1)
+            final_pairs_.push_back({key, first, i, false});
+        } else {
+          for (auto j = chain; j; j = next[j - 1]) {
+            if (in_rows[j - 1].GetFinalCollisionSegments() == key)
+              final_pairs_.push_back({key, (u16)(j - 1), i, false});
           }
         }
-        case 4:
-          if (Const::kPrefetchDistance > 0)
-            __builtin_prefetch(in_rows + *prefetch_ptr++);
-          ProduceOutput(in_rows + cg_indices[0], in_rows + cg_indices[3], cg_indices[0], cg_indices[3]);
-          ProduceOutput(in_rows + cg_indices[1], in_rows + cg_indices[3], cg_indices[1], cg_indices[3]);
-          ProduceOutput(in_rows + cg_indices[2], in_rows + cg_indices[3], cg_indices[2], cg_indices[3]);
-        case 3:
-          if (Const::kPrefetchDistance > 0)
-            __builtin_prefetch(in_rows + *prefetch_ptr++);
-          ProduceOutput(in_rows + cg_indices[0], in_rows + cg_indices[2], cg_indices[0], cg_indices[2]);
-          ProduceOutput(in_rows + cg_indices[1], in_rows + cg_indices[2], cg_indices[1], cg_indices[2]);
-        case 2:
-          if (Const::kPrefetchDistance > 0)
-            __builtin_prefetch(in_rows + *prefetch_ptr++);
-          ProduceOutput(in_rows + cg_indices[0], in_rows + cg_indices[1], cg_indices[0], cg_indices[1]);
-        case 1:
-        case 0:
-          break;
       }
-      #undef ProduceOutput
+      // Move to the next input partition - skip the unused strings.
+      i += (Const::kItemsInOutPartition - actual_items);
     }
-    out_buckets->CheckCounters();
+
+    for (auto& pair : final_pairs_) {
+      if (!pair.eliminated)
+        OutputSolutionCandidate(in_rows + pair.first, in_rows + pair.second,
+                                pair.first, pair.second, out_buckets->counter);
     }
-    // The last step doesn't produce proper partitions, so don't touch it.
-    // TODO: This should be extracted into separate step.
-    if (!C::isFinal)
-      out_buckets->ClosePartition(outer_partition);
   }
 
-  solver_.ReportStep("Performed reduction step");
-  if (Const::kReportCollisions)
-    ReportCollisionStructure(collisions_, in_buckets->CountUsedPositions());
-
+  RecordStats(in_buckets, out_buckets, start);
+  solver_.ReportStep("Performed final reduction step");
   return true;
 }
 
 template<typename C, typename S>
+void ReductionStep<C,S>::RecordStats(BucketIndices* in_buckets,
+                                     BucketIndices* out_buckets,
+                                     u64 start_micro) {
+  auto& stats = solver_.stats_.steps[InString::segments_reduced];
+  u64 in_count = in_buckets->CountUsedPositions();
+  // The final step puts solution candidates into the first bucket
+  // (unless they are processed elsewhere) and writes no pair links.
+  u64 out_count = C::isFinal ? out_buckets->counter[0]
+                             : out_buckets->CountUsedPositions();
+  stats.bytes_read = in_count * sizeof(InString);
+  stats.bytes_written = out_count * sizeof(OutString);
+  if (!C::isFinal)
+    stats.bytes_written += in_count * sizeof(PairLink);
+  stats.time_micro = now() - start_micro;
+}
+
+template<typename C, typename S>
+template<typename Output>
 __attribute__((always_inline))
 inline void ReductionStep<C,S>::OutputString(const InString* first, const InString* second,
                                              u16 first_index, u16 second_index,
-                                             u32* counter, u32 in_bucket) {
+                                             Output& output, u32 in_bucket) {
   static_assert((OutString::segments_reduced == InString::segments_reduced + 1) ||
                 // We allow and exception in case of the final step
                 C::isFinal, "Invalid string generation");
@@ -475,13 +742,9 @@ inline void ReductionStep<C,S>::OutputString(const InString* first, const InStri
   auto out_hash_xor = first->GetSecondSegmentRaw() ^ second->GetSecondSegmentRaw();
   const auto out_bucket = out_hash_xor & Const::kBucketNumberMask;
 
-  if (Const::kCheckBucketOverflow)
-    if (UNLIKELY(counter[out_bucket]
-                 >= Const::kItemsInBucket * (out_bucket + 1))) {
-      return;
-    }
-
-  const auto out_index = counter[out_bucket]++;
+  const auto out_index = output.Reserve(out_bucket);
+  if (UNLIKELY(out_index == Output::kNoPosition))
+    return;
   OutString& result = out_strings_[out_index];
 
   // Locate the interesting hash segments in source strings to start XOR there.
@@ -498,7 +761,7 @@ inline void ReductionStep<C,S>::OutputString(const InString* first, const InStri
 
   if (Const::kFilterZeroQWordStrings)
     if (*(u64*)xor_result == 0) {
-      counter[out_bucket]--;
+      output.Release(out_bucket);
       return;
     }
 
@@ -528,22 +791,39 @@ inline void ReductionStep<C,S>::GenerateSolution(const InString* first, const In
         return;
       last_final_segment = first_final_csegment;
     }
-    if (Const::kProcessSolutionCandidateEarly) {
-      solver_.ProcessSolutionCandidate(first->GetLink(), first_index,
-                                       second->GetLink(), second_index);
-    } else {
-      // Put a solution candidate object into the first bucket, always.
-      // There is no need for further separation since all needed information
-      // is stored directly in the instances (full links with positions within
-      // source buckets).
-      const auto out_index = counter[0]++;
-      auto& result = *(SolutionCandidate*)&out_strings_[out_index];
-      result.link1 = first->GetLink();
-      result.link2 = second->GetLink();
-      // We know for sure that we fit into u16, we check in statically in config file.
-      result.link1_position_mod_bucket_size = (u16)(first_index % Const::kItemsInBucket);
-      result.link2_position_mod_bucket_size = (u16)(second_index % Const::kItemsInBucket);
-    }
+    OutputSolutionCandidate(first, second, first_index, second_index, counter);
+  }
+}
+
+template<typename C, typename S>
+__attribute__((always_inline))
+inline void ReductionStep<C,S>::OutputSolutionCandidate(const InString* first,
+                                                        const InString* second,
+                                                        u16 first_index, u16 second_index,
+                                                        u32* counter) {
+  if (Const::kProcessSolutionCandidateEarly) {
+    solver_.ProcessSolutionCandidate(first->GetLink(), first_index,
+                                     second->GetLink(), second_index);
+  } else if (Const::kProcessSolutionCandidatesInThread) {
+    // Hand the candidate over to the companion thread.
+    SolutionCandidate candidate;
+    candidate.link1 = first->GetLink();
+    candidate.link2 = second->GetLink();
+    candidate.link1_position_mod_bucket_size = (u16)(first_index % Const::kBucketStride);
+    candidate.link2_position_mod_bucket_size = (u16)(second_index % Const::kBucketStride);
+    solver_.PushSolutionCandidate(candidate);
+  } else {
+    // Put a solution candidate object into the first bucket, always.
+    // There is no need for further separation since all needed information
+    // is stored directly in the instances (full links with positions within
+    // source buckets).
+    const auto out_index = counter[0]++;
+    auto& result = *(SolutionCandidate*)&out_strings_[out_index];
+    result.link1 = first->GetLink();
+    result.link2 = second->GetLink();
+    // We know for sure that we fit into u16, we check in statically in config file.
+    result.link1_position_mod_bucket_size = (u16)(first_index % Const::kBucketStride);
+    result.link2_position_mod_bucket_size = (u16)(second_index % Const::kBucketStride);
   }
 }
 
@@ -581,37 +861,149 @@ void Solver::ValidatePartialSolution(u32 level,
   }
 }
 
+template<typename Config>
+static MemoryPlan::StepSizes GetStepSizes(bool tight_outputs) {
+  MemoryPlan::StepSizes sizes;
+  sizes.in_size = sizeof(typename Config::InString);
+  // Without tight outputs, the output set is sized for the input type
+  // (larger or equal) which leaves more room for placement.
+  sizes.out_size = tight_outputs ? sizeof(typename Config::OutString)
+                                 : sizeof(typename Config::InString);
+  sizes.link_size = sizeof(PairLink);
+  return sizes;
+}
+
+MemoryPlan Solver::BuildMemoryPlan(bool tight_outputs, u32 slot_count) {
+  std::vector<MemoryPlan::StepSizes> steps(Const::kTotalSegmentsCount - 1);
+  // Step 0 works on freshly generated strings of the same type.
+  steps[0].link_size = sizeof(PairLink);
+  steps[1] = GetStepSizes<ReductionStepConfig<1>>(tight_outputs);
+  steps[2] = GetStepSizes<ReductionStepConfig<2>>(tight_outputs);
+  steps[3] = GetStepSizes<ReductionStepConfig<3>>(tight_outputs);
+  steps[4] = GetStepSizes<ReductionStepConfig<4>>(tight_outputs);
+  steps[5] = GetStepSizes<ReductionStepConfig<5>>(tight_outputs);
+  steps[6] = GetStepSizes<ReductionStepConfig<6>>(tight_outputs);
+  // Step 7 keeps its input and (unless tight) output set as they are.
+  steps[7].out_size = tight_outputs ? sizeof(ReductionStepConfig<7>::OutString) : 0;
+  steps[7].link_size = sizeof(PairLink);
+  steps[8].in_size = sizeof(FinalStepConfig<8>::InString);
+  steps[8].out_size = sizeof(FinalStepConfig<8>::OutString);
+  steps[8].link_size = sizeof(PairLink);
+  return MemoryPlan::Build(sizeof(GeneratedString), steps, slot_count);
+}
+
+const MemoryPlan& Solver::GetMemoryPlan() {
+  static const MemoryPlan plan = [] {
+    auto result = BuildMemoryPlan(Const::kLowMemoryMode, GetMemorySlotCount());
+    if (!result.Verify()) {
+      result.Dump(stderr);
+      fprintf(stderr, "[FATAL ERROR] Invalid memory plan.\n");
+      abort();
+    }
+    return result;
+  }();
+  return plan;
+}
+
+void Solver::ApplyMemoryPlan(u32 stage) {
+  auto& placements = GetMemoryPlan().GetStage(stage);
+  auto get_space = [this](u32 id) {
+    if (id == MemoryPlan::kX1)
+      return space_X1;
+    if (id == MemoryPlan::kX2)
+      return space_X2;
+    return link_indices_[id - MemoryPlan::kFirstLinkIndex];
+  };
+  // Release changed spaces first, so that they don't block new places.
+  // A space kept at the same place keeps its data.
+  for (auto id : range((u32)placements.size())) {
+    auto space = get_space(id);
+    auto& placement = placements[id];
+    if (space->IsUsed() && (placement.size != space->GetSize() ||
+                            placement.place != space->GetPlace()))
+      space->Release();
+  }
+  for (auto id : range((u32)placements.size())) {
+    auto space = get_space(id);
+    auto& placement = placements[id];
+    if (placement.size != 0 && !space->IsUsed())
+      space->Resize(placement.size)->Allocate(placement.place);
+  }
+}
+
 i32 Solver::Run() {
   if (!initialized_)
     return -1;
 
-  // Default space selection strategy.
-  auto FA = SpaceAllocator::FirstAvailable;
+  ReportStep(nullptr, true);
+
+  auto workspace = GetWorkspace();
+  stats_ = RunStats();
+  if (phase_callback_)
+    phase_callback_(Phase::kGeneration);
+  // Spaces are placed by a plan computed once, stage 0 is generation.
+  ApplyMemoryPlan(0);
+  stats_.generation = GenerateStrings(blake, space_X1->As<GeneratedString>(),
+                                      &workspace->buckets[0]);
+  return Reduce(space_X1);
+}
 
+i32 Solver::RunPrepared() {
+  assert(prepared_ && prepared_->ready);
+  Reset(prepared_->inputs);
   ReportStep(nullptr, true);
 
-  space_X2->Allocate(FA);
-  space_X1->Allocate(FA);
-  BucketIndices buckets1;
-  BucketIndices buckets2;
-  buckets1.Reset();
+  auto workspace = GetWorkspace();
+  stats_ = RunStats();
+  stats_.generation = prepared_->stats;
+  workspace->buckets[0] = prepared_->buckets;
+  prepared_->ready = false;
+  // The plan places (unused) X1 for stages 0 and 1 anyway.
+  ApplyMemoryPlan(0);
+  return Reduce(prepared_->space);
+}
+
+void Solver::PrepareNext(const Inputs& inputs) {
+  if (!prepared_)
+    prepared_.reset(new Prepared());
+  auto& prepared = *prepared_;
+  if (prepared.space == nullptr) {
+    // One string set only, it must not occupy a whole slab of the shared
+    // arena.
+    PoolOptions options;
+    options.use_shared_arena = false;
+    prepared.allocator.MapPool(options);
+    prepared.space = prepared.allocator.Allocate<GeneratedString>("XN", 0);
+  }
+  prepared.inputs = inputs;
+  PrecomputeAligned(prepared.blake, inputs.data, sizeof inputs.data);
+  prepared.stats = GenerateStrings(prepared.blake,
+                                   prepared.space->As<GeneratedString>(),
+                                   &prepared.buckets);
+  prepared.ready = true;
+}
+
+StepStats Solver::GenerateStrings(Blake2b& hasher, GeneratedString* output,
+                                  BucketIndices* buckets) {
+  auto start = now();
+  buckets->Reset();
 
   if (Const::kGenerateTestSet)
-    GenerateXStringsTest(space_X1, &buckets1);
+    GenerateXStringsTest(output, buckets);
   else {
     // Only when it is allowed and we detected a batch backend,
     // use batch string generation.
-    auto batch_size = blake.GetBatchSize();
+    auto batch_size = hasher.GetBatchSize();
     if (RunTimeConfig.kAllowBlake2bInBatches && batch_size > 0) {
       switch (batch_size) {
         case 4:
-          GenerateXStringsBatch<4>(space_X1, &buckets1);
+          GenerateXStringsBatch<4>(hasher, output, buckets);
           break;
         case 2:
-          GenerateXStringsBatch<2>(space_X1, &buckets1);
+          GenerateXStringsBatch<2>(hasher, output, buckets);
           break;
         case 1:
-          GenerateXStringsBatch<1>(space_X1, &buckets1);
+          GenerateXStringsBatch<1>(hasher, output, buckets);
           break;
         default:
           fprintf(stderr, "Invalid blake batch size %d\n", batch_size);
@@ -619,137 +1011,159 @@ i32 Solver::Run() {
       }
     }
     else
-      GenerateXStrings(space_X1, &buckets1);
+      GenerateXStrings(hasher, output, buckets);
   }
 
-  buckets1.ClosePartitionsForNewStrings();
+  buckets->ClosePartitionsForNewStrings();
+  StepStats stats;
+  stats.bytes_written = buckets->CountUsedPositions() * sizeof(GeneratedString);
+  stats.time_micro = now() - start;
+  return stats;
+}
 
-  context_->Allocate();
+i32 Solver::Reduce(Space* generated) {
+  auto workspace = GetWorkspace();
+  auto context = &workspace->context;
+  auto& buckets1 = workspace->buckets[0];
+  auto& buckets2 = workspace->buckets[1];
+  if (StopRequested())
+    return 0;
+  if (phase_callback_)
+    phase_callback_(Phase::kReduction);
 
   using Step0 = ReductionStep<ReductionStepConfig<0>, Solver>;
   auto step0 = Step0{*this};
-  step0.in_strings = space_X1;
+  ApplyMemoryPlan(1);
+  step0.in_strings = generated;
   step0.out_strings = space_X2;
-  step0.target_link_index = link_indices_[step0.segments_reduced]->Allocate(
-      FA);
-  if (!step0.Execute(context_, &buckets1, &buckets2)) {
+  step0.target_link_index = link_indices_[step0.segments_reduced];
+  auto step0_result = step0.Execute(context, &buckets1, &buckets2);
+  if (phase_callback_)
+    phase_callback_(Phase::kGeneratedStringsConsumed);
+  if (!step0_result || StopRequested()) {
     return 0;
   }
   using Step1 = ReductionStep<ReductionStepConfig<1>, Solver>;
   auto step1 = Step1{*this};
-  space_X2->Resize<typename Step1::InString>();
-  space_X1->Reallocate<typename Step1::InString>(FA);
+  ApplyMemoryPlan(2);
   step1.in_strings = space_X2;
   step1.out_strings = space_X1;
-  step1.target_link_index = link_indices_[step1.segments_reduced]
-      ->Allocate(FA);
-  if (!step1.Execute(context_, &buckets2, &buckets1)) {
+  step1.target_link_index = link_indices_[step1.segments_reduced];
+  if (!step1.Execute(context, &buckets2, &buckets1) ||
+      StopRequested()) {
     return 0;
   }
 
   using Step2 = ReductionStep<ReductionStepConfig<2>, Solver>;
   auto step2 = Step2{*this};
-  space_X1->Resize<typename Step2::InString>();
-  space_X2->Reallocate<typename Step2::InString>(FA);
+  ApplyMemoryPlan(3);
   step2.in_strings = space_X1;
   step2.out_strings = space_X2;
-  step2.target_link_index = link_indices_[step2.segments_reduced]
-      ->Allocate(FA);
-  if (!step2.Execute(context_, &buckets1, &buckets2)) {
+  step2.target_link_index = link_indices_[step2.segments_reduced];
+  if (!step2.Execute(context, &buckets1, &buckets2) ||
+      StopRequested()) {
     return 0;
   }
 
   using Step3 = ReductionStep<ReductionStepConfig<3>, Solver>;
   auto step3 = Step3{*this};
-  space_X2->Resize<typename Step3::InString>();
-  space_X1->Reallocate<typename Step3::InString>(FA);
+  ApplyMemoryPlan(4);
   step3.in_strings = space_X2;
   step3.out_strings = space_X1;
-  step3.target_link_index = link_indices_[step3.segments_reduced]
-      ->Allocate(FA);
-  if (!step3.Execute(context_, &buckets2, &buckets1)) {
+  step3.target_link_index = link_indices_[step3.segments_reduced];
+  if (!step3.Execute(context, &buckets2, &buckets1) ||
+      StopRequested()) {
     return 0;
   }
 
   using Step4 = ReductionStep<ReductionStepConfig<4>, Solver>;
   auto step4 = Step4{*this};
-  space_X1->Resize<typename Step4::InString>();
-  space_X2->Reallocate<typename Step4::InString>(FA);
+  ApplyMemoryPlan(5);
   step4.in_strings = space_X1;
   step4.out_strings = space_X2;
-  step4.target_link_index = link_indices_[step4.segments_reduced]
-      ->Allocate(FA);
-  if (!step4.Execute(context_, &buckets1, &buckets2)) {
+  step4.target_link_index = link_indices_[step4.segments_reduced];
+  if (!step4.Execute(context, &buckets1, &buckets2) ||
+      StopRequested()) {
     return 0;
   }
 
   using Step5 = ReductionStep<ReductionStepConfig<5>, Solver>;
   auto step5 = Step5{*this};
-  space_X2->Resize<typename Step5::InString>();
-  space_X1->Reallocate<typename Step5::InString>(FA);
+  ApplyMemoryPlan(6);
   step5.in_strings = space_X2;
   step5.out_strings = space_X1;
-  step5.target_link_index = link_indices_[step5.segments_reduced]
-      ->Allocate(FA);
-  if (!step5.Execute(context_, &buckets2, &buckets1)) {
+  step5.target_link_index = link_indices_[step5.segments_reduced];
+  if (!step5.Execute(context, &buckets2, &buckets1) ||
+      StopRequested()) {
     return 0;
   }
 
   using Step6 = ReductionStep<ReductionStepConfig<6>, Solver>;
   auto step6 = Step6{*this};
-  space_X1->Resize<typename Step6::InString>();
-  space_X2->Reallocate<typename Step6::InString>(FA);
+  ApplyMemoryPlan(7);
   step6.in_strings = space_X1;
   step6.out_strings = space_X2;
-  step6.target_link_index = link_indices_[step6.segments_reduced]
-      ->Allocate(FA);
-  if (!step6.Execute(context_, &buckets1, &buckets2)) {
+  step6.target_link_index = link_indices_[step6.segments_reduced];
+  if (!step6.Execute(context, &buckets1, &buckets2) ||
+      StopRequested()) {
     return 0;
   }
 
   using Step7 = ReductionStep<ReductionStepConfig<7>, Solver>;
   auto step7 = Step7{*this};
-  // space_S2->Release();
+  ApplyMemoryPlan(8);
   step7.in_strings = space_X2;
   step7.out_strings = space_X1;
-  step7.target_link_index = link_indices_[step7.segments_reduced]->Allocate(FA);
-  if (!step7.Execute(context_, &buckets2, &buckets1)) {
+  step7.target_link_index = link_indices_[step7.segments_reduced];
+  if (!step7.Execute(context, &buckets2, &buckets1) ||
+      StopRequested()) {
     return 0;
   }
 
   using Step8 = ReductionStep<FinalStepConfig<8>, Solver>;
   auto step8 = Step8{*this};
-  space_X1->Resize<typename Step8::InString>();
-  space_X2->Reallocate<typename Step8::OutString>(FA);
+  ApplyMemoryPlan(9);
   step8.in_strings = space_X1;
   step8.out_strings = space_X2;
-  step8.target_link_index = link_indices_[step8.segments_reduced]
-      ->Allocate(FA);
-  if (!step8.Execute(context_, &buckets1, &buckets2)) {
+  step8.target_link_index = link_indices_[step8.segments_reduced];
+
+  // Candidates are validated by a companion thread while step8 runs.
+  // Lower level link indices are not modified by step8 so the thread can
+  // safely read them.
+  bool step8_result;
+  if (Const::kProcessSolutionCandidatesInThread) {
+    candidate_ring_->Reset();
+    candidates_done_.store(false, std::memory_order_relaxed);
+    candidate_team_->Run([&](u32 member) {
+      if (member != 0) {
+        ProcessSolutionCandidatesLoop();
+        return;
+      }
+      step8_result = step8.Execute(context, &buckets1, &buckets2);
+      candidates_done_.store(true, std::memory_order_release);
+    });
+  } else {
+    step8_result = step8.Execute(context, &buckets1, &buckets2);
+  }
+  if (!step8_result) {
     return 0;
   }
 
   // Handle solution candidates created in step8, if they were not already
   // processed during the step itself. Both options are possible based
   // on given configuration.
-  if (!Const::kProcessSolutionCandidateEarly) {
+  if (!Const::kProcessSolutionCandidateEarly &&
+      !Const::kProcessSolutionCandidatesInThread) {
     auto candidates = step8.out_strings->As<typename Step8::OutString>();
     auto candidates_count = buckets2.counter[0];
 
     for (auto i : range(candidates_count)) {
+      if (IsStopped())
+        break;
       // We need to cast here because in general Step8::OutString can be a bigger
       // type then SolutionCandidate.
       auto& candidate = *(SolutionCandidate*)&candidates[i];
-      auto l1 = candidate.link1.Translate(candidate.link1_position_mod_bucket_size);
-      auto l2 = candidate.link2.Translate(candidate.link2_position_mod_bucket_size);
-      // Most of the duplicates is introduced in the last step. Check this case
-      // eagerly here, it really pays off.
-      if (l1.first == l2.first || l1.second == l2.second ||
-          l1.first == l2.second || l1.second == l2.first) {
-        continue;
-      }
-      ProcessSolutionCandidate(candidate.link1, candidate.link1_position_mod_bucket_size,
-                               candidate.link2, candidate.link2_position_mod_bucket_size);
+      ProcessSolutionCandidate(candidate);
     }
   }
 
@@ -784,8 +1198,28 @@ inline void ExpandArrayFast(const u8* __restrict hash,
   }
 }
 
+// Packs indices of a solution into its minimal encoding: indices of
+// `kHashSegmentBits` + 1 bits one after another, big-endian.
+static void PackMinimalSolution(const u32* indices, u8* output) {
+  constexpr u32 index_bits = Const::kHashSegmentBits + 1;
+  static_assert(index_bits + 7 <= 64, "");
+  u64 buffer = 0;
+  u32 bits = 0;
+  for (auto i : range(Const::kSolutionSize)) {
+    buffer = (buffer << index_bits) | indices[i];
+    bits += index_bits;
+    while (bits >= 8) {
+      bits -= 8;
+      *output++ = (u8)(buffer >> bits);
+    }
+  }
+  assert(bits == 0);
+}
+
 void Solver::ProcessSolutionCandidate(PairLink l8_link1, u32 link1_position,
                                       PairLink l8_link2, u32 link2_position) {
+  if (IsStopped())
+    return;
   // Make space for a new solution.
   if (solution_objects_.size() < valid_solutions_ + 1)
     solution_objects_.emplace_back(Const::kSolutionSize);
@@ -810,6 +1244,51 @@ void Solver::ProcessSolutionCandidate(PairLink l8_link1, u32 link1_position,
   // Reorder the solution if it is valid
   ReorderSolution(solution);
   valid_solutions_++;
+
+  if (solution_output_) {
+    auto count = solution_output_count_.load(std::memory_order_relaxed);
+    if (solution_output_wrap_ || count < solution_output_capacity_)
+      PackMinimalSolution(solution.data(), solution_output_ +
+                          (count % solution_output_capacity_) * Const::kMinimalSolutionBytes);
+    solution_output_count_.store(count + 1, std::memory_order_release);
+  }
+
+  if (solution_callback_ && solution_callback_(solution))
+    stopped_.store(true, std::memory_order_relaxed);
+}
+
+void Solver::ProcessSolutionCandidate(SolutionCandidate& candidate) {
+  auto l1 = candidate.link1.Translate(candidate.link1_position_mod_bucket_size);
+  auto l2 = candidate.link2.Translate(candidate.link2_position_mod_bucket_size);
+  // Most of the duplicates is introduced in the last step. Check this case
+  // eagerly here, it really pays off.
+  if (l1.first == l2.first || l1.second == l2.second ||
+      l1.first == l2.second || l1.second == l2.first) {
+    return;
+  }
+  ProcessSolutionCandidate(candidate.link1, candidate.link1_position_mod_bucket_size,
+                           candidate.link2, candidate.link2_position_mod_bucket_size);
+}
+
+void Solver::PushSolutionCandidate(const SolutionCandidate& candidate) {
+  // The ring is full only when the companion thread falls behind a lot.
+  while (UNLIKELY(!candidate_ring_->Push(candidate)))
+    std::this_thread::yield();
+}
+
+void Solver::ProcessSolutionCandidatesLoop() {
+  SolutionCandidate candidate;
+  while (true) {
+    // Read the flag before trying the ring, so no candidate pushed before
+    // the producer finished can be missed.
+    auto done = candidates_done_.load(std::memory_order_acquire);
+    if (candidate_ring_->Pop(candidate))
+      ProcessSolutionCandidate(candidate);
+    else if (done)
+      break;
+    else
+      std::this_thread::yield();
+  }
 }
 
 static bool CheckUniqueness(std::vector<u32>& solution) {
@@ -935,14 +1414,17 @@ bool Solver::RecomputeSolution(std::vector<u32>& solution, u32 level,
     fprintf(stderr, "Solver not initialized");
     return false;
   }
+  return verifier_.RecomputeSolution(solution, level,
+                                     check_ordering, check_uniqueness);
+}
 
+bool SolutionVerifier::RecomputeSolution(std::vector<u32>& solution, u32 level,
+                                         bool check_ordering, bool check_uniqueness) {
   auto solution_size = 2 * (1u << level);
   assert(solution_size <= Const::kSolutionSize);
   if (solution.size() != solution_size)
     return false;
 
-  OneTimeString xstrings[Const::kSolutionSize];
-
   if (check_uniqueness) {
     temporary_solution_.resize(solution_size);
     memcpy(temporary_solution_.data(), solution.data(),
@@ -951,16 +1433,20 @@ bool Solver::RecomputeSolution(std::vector<u32>& solution, u32 level,
       return false;
   }
 
+  if (!Const::kGenerateTestSet)
+    return RecomputeSolutionBatch(solution, level, check_ordering);
+
+  // Only the test set is recomputed here, real strings go through the
+  // batch path above.
+  auto xstrings = xstrings_;
+
   // Generate all strings from given indices
   for (auto i : range(solution.size())) {
     u32 string_index = solution[i];
     // The index must be in valid bounds
     if (string_index >= Const::kInitialStringSetSize)
       return false;
-    if (Const::kGenerateTestSet)
-      GenerateOTStringTest(solution[i], xstrings[i]);
-    else
-      GenerateOTString(string_index, xstrings[i]);
+    GenerateOTStringTest(string_index, xstrings[i]);
   }
 
   auto indices = solution.data();
@@ -1001,6 +1487,130 @@ bool Solver::RecomputeSolution(std::vector<u32>& solution, u32 level,
   return true;
 }
 
+void SolutionVerifier::GenerateStringSlots(std::vector<u32>& solution) {
+  constexpr i32 half_hash_length = Const::N_parameter / 8;
+  constexpr u32 max_batch_size = 8;
+  auto solution_size = (u32)solution.size();
+
+  // Sort the strings by blake2b index so that strings sharing one hash
+  // are together and the hash is computed only once for them.
+  for (auto i : range(solution_size))
+    sorted_keys_[i] = ((u64)(solution[i] / 2) << 32) | i;
+  std::sort(sorted_keys_, sorted_keys_ + solution_size);
+
+  auto batch_size = blake_.CanBatchFinalizeIndices() ? blake_.GetBatchSize() : 1;
+  assert(batch_size <= max_batch_size);
+  alignas(32) State blake_result;
+  u32 g_values[max_batch_size];
+  u32 group_start[max_batch_size + 1];
+
+  u32 key = 0;
+  while (key < solution_size) {
+    // Gather a batch of distinct indices and remember where the strings
+    // using each of them start in the sorted keys.
+    u32 count = 0;
+    while (count < batch_size && key < solution_size) {
+      auto g = (u32)(sorted_keys_[key] >> 32);
+      g_values[count] = g;
+      group_start[count++] = key;
+      while (key < solution_size && (u32)(sorted_keys_[key] >> 32) == g)
+        key++;
+    }
+    group_start[count] = key;
+
+    const u8* hashes;
+    u32 hash_stride;
+    if (blake_.CanBatchFinalizeIndices()) {
+      // Fill the rest of the last batch by a valid index.
+      for (auto i : range(count, batch_size))
+        g_values[i] = g_values[count - 1];
+      blake_.BatchFinalizeIndices(g_values);
+      hashes = (const u8*)blake_.GetHashOutputMemory();
+      hash_stride = sizeof(BatchHash);
+    } else {
+      blake_.FinalizeInto(blake_result, g_values[0]);
+      hashes = blake_result.hash;
+      hash_stride = 0;
+    }
+
+    for (auto i : range(count)) {
+      for (auto k : range(group_start[i], group_start[i + 1])) {
+        auto position = (u32)sorted_keys_[k];
+        auto half = solution[position] % 2;
+        ExpandArrayFast(hashes + i * hash_stride + half * half_hash_length,
+                        string_slots_[position]);
+      }
+    }
+  }
+}
+
+// Xor the second string of each pair (in `distance`) into the first one.
+__attribute__((target("avx2")))
+static void XorStringSlotsAVX2(u8 (*slots)[32], u32 count, u32 distance) {
+  for (u32 first = 0; first < count; first += 2 * distance) {
+    auto x1 = _mm256_loadu_si256((const __m256i*)slots[first]);
+    auto x2 = _mm256_loadu_si256((const __m256i*)slots[first + distance]);
+    _mm256_storeu_si256((__m256i*)slots[first], _mm256_xor_si256(x1, x2));
+  }
+}
+
+static void XorStringSlotsSSE2(u8 (*slots)[32], u32 count, u32 distance) {
+  for (u32 first = 0; first < count; first += 2 * distance) {
+    auto x1 = (__m128i*)slots[first];
+    auto x2 = (const __m128i*)slots[first + distance];
+    _mm_storeu_si128(x1, _mm_xor_si128(_mm_loadu_si128(x1), _mm_loadu_si128(x2)));
+    _mm_storeu_si128(x1 + 1, _mm_xor_si128(_mm_loadu_si128(x1 + 1),
+                                           _mm_loadu_si128(x2 + 1)));
+  }
+}
+
+static inline u32 GetSlotSegment(const u8* slot, u32 segment) {
+  static_assert(Const::kHashSegmentBytes == 3, "Unexpected slot layout");
+  return *(const u32*)(slot + Const::kHashSegmentBytes * segment)
+      & Const::kHashSegmentBitMask;
+}
+
+bool SolutionVerifier::RecomputeSolutionBatch(std::vector<u32>& solution, u32 level,
+                                              bool check_ordering) {
+  static_assert(OneTimeString::hash_length <= sizeof(StringSlot), "");
+  auto solution_size = (u32)solution.size();
+  auto indices = solution.data();
+
+  for (auto i : range(solution_size)) {
+    // The index must be in valid bounds
+    if (indices[i] >= Const::kInitialStringSetSize)
+      return false;
+  }
+  GenerateStringSlots(solution);
+
+  // Combine the stings in a binary tree-like manner. Whole slots are xor-ed,
+  // already reduced segments are 0 in both strings so they stay 0.
+  for (auto segment : range(level + 1)) {
+    u32 pair_distance = 1u << segment;
+    u32 next_pair = pair_distance * 2;
+    if (check_ordering) {
+      for (u32 first = 0; first < solution_size; first += next_pair) {
+        if (indices[first] >= indices[first + pair_distance])
+          return false;
+      }
+    }
+    if (use_avx2_)
+      XorStringSlotsAVX2(string_slots_, solution_size, pair_distance);
+    else
+      XorStringSlotsSSE2(string_slots_, solution_size, pair_distance);
+    for (u32 first = 0; first < solution_size; first += next_pair) {
+      // The i-th segment is supposed to be 0!
+      if (GetSlotSegment(string_slots_[first], segment))
+        return false;
+    }
+  }
+  // The last segment of the final string must be 0 as well.
+  if (level == 8 && GetSlotSegment(string_slots_[0], 9) != 0u)
+    return false;
+
+  return true;
+}
+
 template<typename C, typename S>
 void ReductionStep<C,S>::ReportCollisionStructure(std::vector<u32>& collisions, u32 string_count) {
   u64 total_pairs = 0;
@@ -1019,11 +1629,6 @@ void ReductionStep<C,S>::ReportCollisionStructure(std::vector<u32>& collisions,
          total_collisions, string_count);
 }
 
-static inline u64 now() {
-  return (u64)std::chrono::steady_clock::now()
-      .time_since_epoch().count() / 1000;
-}
-
 void Solver::ResetTimer() {
   if (!Const::kReportSteps)
     return;
@@ -2,13 +2,18 @@
 #ifndef ZCEQ_SOLVER_H_
 #define ZCEQ_SOLVER_H_
 
+#include <atomic>
 #include <cassert>
 #include <cmath>
+#include <cstddef>
+#include <functional>
+#include <memory>
 #include <vector>
 #include <cstring>
 
 #include "zceq_config.h"
 #include "zceq_blake2b.h"
+#include "zceq_memory_plan.h"
 #include "zceq_misc.h"
 #include "zceq_space_allocator.h"
 
@@ -20,16 +25,19 @@ namespace zceq_solver {
 
 using BlakeState = crypto_generichash_blake2b_state;
 
+// Block header with the nonce in its last 8 bytes (little endian u64).
 union Inputs {
   u8 data[140];
   struct {
     u8 unused[132];
     u64 nonce;
-  } s;
+  } __attribute__((packed)) s;
   void SetSimpleNonce(u64 nonce) {
     s.nonce = nonce;
   }
 };
+static_assert(offsetof(Inputs, s.nonce) == 132 && sizeof(Inputs) == 140,
+              "The nonce must be the last 8 bytes of the header");
 
 class PairLink {
   u32 data_;
@@ -56,7 +64,9 @@ class PairLink {
   }
   inline void copy_nt(PairLink value) {
     static_assert(sizeof(i32) == sizeof *this, "Different size of pair link used for nt-store");
-    _mm_stream_si32((int*)this, value.data_);
+    // Links are always 4B aligned, but converting the packed `this` to
+    // int* directly warns about an unaligned pointer.
+    store_nt_u32(this, value.data_);
   }
   inline Translated Translate(u64 link_position) {
     auto indices = data_ & ((1u << Const::kBucketInIndexShift) - 1);
@@ -69,24 +79,24 @@ class PairLink {
     smaller -= larger * over;
     larger += over;
 
-    auto partition = u32((link_position % Const::kItemsInBucket) / Const::kItemsInOutPartition);
+    auto partition = u32((link_position % Const::kBucketStride) / Const::kItemsInOutPartition);
     partition &= ((1u << Const::kPartitionCountBits) - 1);
     auto bucket = (u32)(partition << (32u - Const::kBucketInIndexShift) |
                         data_ >> Const::kBucketInIndexShift);
 
     auto result = Translated{
-        u32(Const::kItemsInBucket * bucket + smaller),
-        u32(Const::kItemsInBucket * bucket + larger)
+        u32(Const::kBucketStride * bucket + smaller),
+        u32(Const::kBucketStride * bucket + larger)
     };
     return result;
   }
 
   inline bool Validate(u64 link_position) {
     auto tr = Translate(link_position);
-    PairLink link {tr.second % Const::kItemsInBucket, tr.first % Const::kItemsInBucket,
-                   tr.first / Const::kItemsInBucket};
+    PairLink link {tr.second % Const::kBucketStride, tr.first % Const::kBucketStride,
+                   tr.first / Const::kBucketStride};
     return link.GetData() == GetData() &&
-        ((tr.first / Const::kItemsInBucket) == (tr.second / Const::kItemsInBucket));
+        ((tr.first / Const::kBucketStride) == (tr.second / Const::kBucketStride));
   }
 
   inline u32 GetData() {
@@ -282,7 +292,7 @@ struct BucketIndices {
 
   void Reset() {
     for (auto i : range(Const::kBucketCount)) {
-      counter[i] = (i * Const::kItemsInBucket);
+      counter[i] = (i * Const::kBucketStride);
     }
     memset(partition_sizes, 0, sizeof partition_sizes);
   }
@@ -302,7 +312,7 @@ struct BucketIndices {
 
   void CheckCounters() {
     for (auto i : range(Const::kBucketCount)) {
-      auto diff = counter[i] - (i * Const::kItemsInBucket);
+      auto diff = counter[i] - (i * Const::kBucketStride);
       if (diff > Const::kItemsInBucket)
         assert(false);
     }
@@ -313,7 +323,7 @@ struct BucketIndices {
 
     // Record the partition size for each bucket
     for (auto i : range(Const::kBucketCount)) {
-      auto size = counter[i] - (i * Const::kItemsInBucket) - shift;
+      auto size = counter[i] - (i * Const::kBucketStride) - shift;
       assert(size <= Const::kItemsInBucket);
       // Ensure that the size is always within bounds.
       partition_sizes[i][partition] = std::min((u16)size, (u16)Const::kItemsInOutPartition);
@@ -328,7 +338,7 @@ struct BucketIndices {
       // is backwards! but it simply means that the strings could not be
       // properly coded in pair link indices.
       for (auto i : range(Const::kBucketCount)) {
-        counter[i] = (i * Const::kItemsInBucket) + shift;
+        counter[i] = (i * Const::kBucketStride) + shift;
       }
     }
   }
@@ -336,7 +346,7 @@ struct BucketIndices {
   void ClosePartitionsForNewStrings() {
      // Record the partition size for each bucket
     for (auto i : range(Const::kBucketCount)) {
-      auto bucket_start = (i * Const::kItemsInBucket);
+      auto bucket_start = (i * Const::kBucketStride);
       for (auto part : range(Const::kPartitionCount)) {
         auto part_start = bucket_start + part * Const::kItemsInOutPartition;
         if (part_start >= counter[i])
@@ -348,17 +358,121 @@ struct BucketIndices {
   }
 };
 
+// Output position reservation of a reduction step run in one thread. The
+// strings are appended at bucket counters.
+struct DirectOutput {
+  static constexpr u32 kNoPosition = (u32)-1;
+  u32* counter;
+
+  // Returns a position for a new string of `bucket` or `kNoPosition`
+  // when the bucket is full.
+  inline u32 Reserve(u32 bucket) {
+    if (Const::kCheckBucketOverflow)
+      if (UNLIKELY(counter[bucket] >= Const::kBucketStride * bucket + Const::kItemsInBucket))
+        return kNoPosition;
+    return counter[bucket]++;
+  }
+  // Returns the last reserved position of `bucket` (the string was
+  // filtered out).
+  inline void Release(u32 bucket) {
+    counter[bucket]--;
+  }
+};
+
+// Output position reservation of one thread of a reduction step run in
+// more threads (see `Solver::SetStepThreads`). Bucket counters are shared
+// by all threads, a thread claims `kOutputChunkSize` positions of a bucket
+// by an atomic increment and fills them locally. Chunks are never claimed
+// behind the end of a bucket, but the shared counter can get there.
+// When a partition ends, the unused rest of the current chunk of each
+// bucket [next, end) is a hole among valid strings. The holes are filled
+// by `ReductionStep::CloseSharedPartition` so that counters and
+// partition sizes have the usual meaning again.
+struct ChunkedOutput {
+  static constexpr u32 kNoPosition = (u32)-1;
+  u32* counter = nullptr;
+  u32 next[Const::kBucketCount];
+  u32 end[Const::kBucketCount];
+
+  void Reset(u32* shared_counter) {
+    counter = shared_counter;
+    memset(next, 0, sizeof next);
+    memset(end, 0, sizeof end);
+  }
+  inline u32 Reserve(u32 bucket) {
+    if (UNLIKELY(next[bucket] == end[bucket])) {
+      auto bucket_end = Const::kBucketStride * bucket + Const::kItemsInBucket;
+      auto start = __atomic_fetch_add(&counter[bucket], Const::kOutputChunkSize,
+                                      __ATOMIC_RELAXED);
+      if (UNLIKELY(start >= bucket_end))
+        return kNoPosition;
+      next[bucket] = start;
+      end[bucket] = std::min(start + Const::kOutputChunkSize, bucket_end);
+    }
+    return next[bucket]++;
+  }
+  inline void Release(u32 bucket) {
+    next[bucket]--;
+  }
+};
+
+// Scratch space of collision search within one bucket.
 struct Context {
-  vector<u16> hash;
-  vector<u16> count;
-  vector<u16> cum_sum;
-  vector<u16> collisions;
+  u16 hash[Const::kItemsInBucket];
+  u16 count[Const::kHashTableSize];
+  u16 cum_sum[Const::kHashTableSize];
+  u16 collisions[Const::kItemsInBucket];
+};
 
-  void Allocate() {
-    hash.resize(Const::kItemsInBucket);
-    count.resize(Const::kHashTableSize);
-    cum_sum.resize(Const::kHashTableSize);
-    collisions.resize(Const::kItemsInBucket);
+// Solver data structures which are not string sets or link indices. They
+// are small and needed by all steps, so they are kept in the fixed area of
+// the space allocator. The memory pool is then the whole solver footprint
+// (besides solutions handed out to a user).
+struct Workspace {
+  Context context;
+  BucketIndices buckets[2];
+  // Hash table of the final step engine, slots are tagged by `final_stamp`.
+  // The final step runs in one thread, so step workers don't need it.
+  u32 final_heads[Const::kUseFinalStepEngine ? Const::kFinalTableSize : 1];
+  u16 final_stamp;
+};
+
+// State of one thread of a reduction step run in more threads.
+struct StepWorker {
+  Context context;
+  ChunkedOutput output;
+};
+
+// Memory traffic and duration of one phase of a solver run. The traffic
+// is derived from string counts and sizes: each input string is read
+// once, output strings and pair links are written once (work within a
+// bucket is expected to stay in caches).
+struct StepStats {
+  u64 bytes_read = 0;
+  u64 bytes_written = 0;
+  u64 time_micro = 0;
+
+  void Add(const StepStats& other) {
+    bytes_read += other.bytes_read;
+    bytes_written += other.bytes_written;
+    time_micro += other.time_micro;
+  }
+  // Achieved bandwidth in GB/s (10^9 bytes).
+  double GetBandwidth() const {
+    return time_micro ? (bytes_read + bytes_written) / (time_micro * 1000.0) : 0.0;
+  }
+};
+
+// Statistics of the last solver run (see `Solver::GetRunStats`).
+struct RunStats {
+  StepStats generation;
+  // Indexed by the reduction step number.
+  StepStats steps[Const::K_parameter];
+
+  void Add(const RunStats& other) {
+    generation.Add(other.generation);
+    for (auto i : range(Const::K_parameter))
+      steps[i].Add(other.steps[i]);
   }
 };
 
@@ -382,14 +496,28 @@ class ReductionStep {
 
   bool PrepareRTConfiguration();
   bool Execute(Context* context, BucketIndices* input_buckets, BucketIndices* output_buckets) noexcept;
+  bool ExecuteFinal(Context* context, BucketIndices* input_buckets, BucketIndices* output_buckets) noexcept;
+  template<typename Output>
   inline void OutputString(const InString* first, const InString* second,
                            u16 first_index, u16 second_index,
-                           u32* counter, u32 in_bucket);
+                           Output& output, u32 in_bucket);
   inline void GenerateSolution(const InString* first, const InString* second,
                                u16 first_index, u16 second_index, u32* counter);
+  inline void OutputSolutionCandidate(const InString* first, const InString* second,
+                                      u16 first_index, u16 second_index, u32* counter);
 
  protected:
+  // Searches collisions in strings of one input bucket, `Output` is
+  // `DirectOutput` or `ChunkedOutput`.
+  template<typename Output>
+  void ProcessBucket(Context* context, BucketIndices* in_buckets,
+                     BucketIndices* out_buckets, u32 in_bucket, Output& output);
+  // Removes holes left by threads in output buckets and closes the
+  // partition.
+  void CloseSharedPartition(u32 partition, BucketIndices* out_buckets);
   void OutputIndex(PairLink* target, PairLink);
+  void RecordStats(BucketIndices* in_buckets, BucketIndices* out_buckets,
+                   u64 start_micro);
   void ReportCollisionStructure(std::vector<u32>& collisions, u32 string_count);
 
   SolverT& solver_;
@@ -400,28 +528,150 @@ class ReductionStep {
 
   u64 last_final_segment = (u64)-1ll;
   std::vector<u32> collisions_;
+
+  // Candidate pair found by the final step engine within one bucket.
+  struct FinalPair {
+    u64 key;
+    u16 first;
+    u16 second;
+    bool eliminated;
+  };
+  std::vector<FinalPair> final_pairs_;
 };
 
-class Solver {
+// Recomputes strings of a (partial) solution from scratch and checks that
+// they collide as expected. It needs only a prepared Blake2b instance and
+// scratch space for one solution, it doesn't touch solver's memory pool.
+class SolutionVerifier {
  public:
-  using Space = SpaceAllocator::Space;
-
   // Expanded, not reduced string with 0 skipped bits.
   using OneTimeString = XString<0, true, 0>;
+
+  SolutionVerifier(Blake2b& blake) : blake_(blake),
+                                     use_avx2_(HasAvx2Support()) {}
+  SolutionVerifier(const SolutionVerifier&) = delete;
+
+  void GenerateOTString(u32 index, OneTimeString& result);
+  void GenerateOTStringTest(u32 index, OneTimeString& result);
+  bool RecomputeSolution(std::vector<u32>& solution, u32 level,
+                         bool check_ordering, bool check_uniqueness);
+
+ protected:
+  // One expanded string hash (30B) padded to 32B, so that two strings can be
+  // xor-ed by a single AVX2 instruction.
+  using StringSlot = u8[32];
+
+  bool RecomputeSolutionBatch(std::vector<u32>& solution, u32 level,
+                              bool check_ordering);
+  void GenerateStringSlots(std::vector<u32>& solution);
+
+  Blake2b& blake_;
+  bool use_avx2_;
+  std::vector<u32> temporary_solution_;
+  OneTimeString xstrings_[Const::kSolutionSize];
+  // Blake2b index (g) in upper half and position in a solution in lower half.
+  u64 sorted_keys_[Const::kSolutionSize];
+  StringSlot string_slots_[Const::kSolutionSize];
+};
+
+// Validation only counterpart of the solver. It holds only blake2b state
+// and a verification scratch space (no space allocator), so it is cheap
+// to have many instances.
+class Verifier : public AlignedNew {
+ public:
+  Verifier() : blake(true), verifier_(blake) {}
+  Verifier(const Verifier&) = delete;
+
+  void Reset(const u8* data, u64 length);
+  void Reset(Inputs& inputs);
+
+  bool ValidateSolution(std::vector<u32>& solution) {
+    if (!initialized_) {
+      fprintf(stderr, "Verifier not initialized");
+      return false;
+    }
+    return verifier_.RecomputeSolution(solution, 8, true, true);
+  }
+
+ protected:
+  Blake2b blake;
+  SolutionVerifier verifier_;
+  bool initialized_ = false;
+};
+
+class Solver : public AlignedNew {
+ public:
+  using Space = SpaceAllocator::Space;
+
+  using OneTimeString = SolutionVerifier::OneTimeString;
   // String type which should be generated before first step. We simply
   // reuse an input type specified for step 0.
   using GeneratedString = ReductionStepConfig<0>::InString;
 
   Solver();
+  // The memory pool is mapped (and prefaulted or locked as requested) at
+  // construction, not on the first run.
+  explicit Solver(const PoolOptions& pool_options);
   Solver(const Solver&) = delete;
   ~Solver();
 
+  // Number of memory pool slots the solver needs.
+  static constexpr u64 GetMemorySlotCount() {
+    return Const::kExpandHashes ? Const::kMemoryForExpandedProblem
+        : Const::kLowMemoryMode ? Const::kMemoryForLowMemoryMode
+                                : Const::kMemoryForNonExpandedProblem;
+  }
+  // Size of one memory pool slot (cache coloring included).
+  static u64 GetMemorySlotSize() {
+    return SpaceAllocator::GetSlotSize(Const::kMaximumStringSetSize,
+                                       Const::kSpaceColoring, Const::kSpaceColors);
+  }
+  // Size of the memory pool of one solver (e.g. a slab of `SharedArena`).
+  static u64 GetMemoryPoolSize() {
+    return SpaceAllocator::GetPoolSize(Const::kMaximumStringSetSize,
+                                       GetMemorySlotCount(), sizeof(Workspace),
+                                       Const::kSpaceColoring, Const::kSpaceColors);
+  }
+  // Maximal memory used so far by one solving, solution objects included.
+  u64 GetPeakMemoryUsage() {
+    return allocator_.GetPeakFootprint()
+        + (prepared_ ? prepared_->allocator.GetPeakFootprint() : 0)
+        + solution_objects_.capacity() * Const::kSolutionSize * sizeof(u32)
+        + step_workers_.size() * sizeof(StepWorker);
+  }
+  // Placement plan of spaces for given output set sizing (see
+  // `kLowMemoryMode`) and pool size. The solver uses the plan of the
+  // current configuration, built and verified once per process.
+  static MemoryPlan BuildMemoryPlan(bool tight_outputs, u32 slot_count);
+  static const MemoryPlan& GetMemoryPlan();
+
+  // Effective page size of the memory pool (0 before the first run).
+  u64 GetPageSize() {
+    return allocator_.GetPageSize();
+  }
+  PagePolicy GetPagePolicy() {
+    return allocator_.GetPagePolicy();
+  }
+
   void Reset(const u8* data, u64 length);
   void Reset(Inputs& inputs);
-  void GenerateOTString(u32 index, OneTimeString& result);
-  void GenerateOTStringTest(u32 index, OneTimeString& result);
+  void GenerateOTString(u32 index, OneTimeString& result) {
+    verifier_.GenerateOTString(index, result);
+  }
+  void GenerateOTStringTest(u32 index, OneTimeString& result) {
+    verifier_.GenerateOTStringTest(index, result);
+  }
   i32 Run();
 
+  // Pipelined solving (see `PipelinedRunner`). `PrepareNext` generates
+  // strings of `inputs` into a separate buffer, it can run in another
+  // thread while `Run` or `RunPrepared` reduce strings of a previous
+  // input (after they reported `Phase::kGeneratedStringsConsumed`).
+  // `RunPrepared` resets the solver to the prepared input and solves it
+  // from the prepared strings.
+  void PrepareNext(const Inputs& inputs);
+  i32 RunPrepared();
+
   const vector<const vector<u32>*>& GetSolutions() {
     solutions_.clear();
     for (auto i : range(valid_solutions_))
@@ -432,6 +682,72 @@ class Solver {
   u32 GetInvalidSolutionCount() {
     return invalid_solutions_;
   }
+  // Memory traffic and timing of phases of the last run.
+  const RunStats& GetRunStats() {
+    return stats_;
+  }
+
+  // Called for each valid solution as soon as it is found (from the
+  // companion thread if `kProcessSolutionCandidatesInThread` is set).
+  // When it returns true, no more solutions are needed and `Run` returns
+  // early with solutions found so far.
+  using SolutionCallback = std::function<bool(const std::vector<u32>&)>;
+  void SetSolutionCallback(SolutionCallback callback) {
+    solution_callback_ = callback;
+  }
+  bool IsStopped() {
+    return stopped_.load(std::memory_order_relaxed);
+  }
+  // Stops `Run` (possibly from another thread) at the next reduction
+  // step, the final step is left at the next bucket. `Reset` clears it.
+  void Stop() {
+    stopped_.store(true, std::memory_order_relaxed);
+  }
+  // Polled by `Run` before each reduction step. When it returns true,
+  // `Run` stops like after the solution callback did, i.e. within one
+  // step, with solutions found so far.
+  using StopCallback = std::function<bool()>;
+  void SetStopCallback(StopCallback callback) {
+    stop_callback_ = callback;
+  }
+  // Registers caller's memory for `capacity` solutions in minimal
+  // encoding (`Const::kMinimalSolutionBytes` each). Every valid solution
+  // is then packed straight into slot n, where n counts solutions passed
+  // to the memory from `count` on (see `GetSolutionOutputCount`). Without
+  // `wrap`, the first `capacity` solutions are kept in order and the
+  // others are dropped; with it, slot `n % capacity` is used, so a ring
+  // keeps the last `capacity` solutions. nullptr unregisters the memory.
+  void SetSolutionOutput(u8* memory, u32 capacity, bool wrap, u64 count = 0) {
+    solution_output_ = capacity ? memory : nullptr;
+    solution_output_capacity_ = capacity;
+    solution_output_wrap_ = wrap;
+    solution_output_count_.store(count, std::memory_order_relaxed);
+  }
+  // Number of solutions passed to the registered memory (dropped ones
+  // included). It can be read by another thread while the solver runs,
+  // slots below the count (and the capacity) are complete.
+  u64 GetSolutionOutputCount() {
+    return solution_output_count_.load(std::memory_order_acquire);
+  }
+  // Called by `Run` when a phase starts: string generation (compute
+  // bound) and the reduction steps (memory bound). It allows to schedule
+  // phases of more solvers against each other (see `NumaRunner`).
+  // `kGeneratedStringsConsumed` follows step 0, the generated strings are
+  // not needed any more.
+  enum class Phase { kGeneration, kReduction, kGeneratedStringsConsumed };
+  using PhaseCallback = std::function<void(Phase)>;
+  void SetPhaseCallback(PhaseCallback callback) {
+    phase_callback_ = callback;
+  }
+  // Runs the reduction steps (except the final one) in `count` threads
+  // which share output buckets (see `ChunkedOutput`). The calling thread
+  // is one of them, the others are started here and kept by the solver.
+  // It makes one solving faster on an otherwise idle machine, not the
+  // throughput of more solvers.
+  void SetStepThreads(u32 count);
+  u32 GetStepThreads() {
+    return std::max((u32)step_workers_.size(), 1u);
+  }
   bool ValidateSolution(std::vector<u32>& solution) {
     return RecomputeSolution(solution, 8, true, true);
   }
@@ -441,18 +757,34 @@ class Solver {
 
  protected:
   void ResetMemoryAllocator();
-  void GenerateXStrings(SpaceAllocator::Space* target_space, BucketIndices* buckets);
+  StepStats GenerateStrings(Blake2b& hasher, GeneratedString* output, BucketIndices* buckets);
+  void GenerateXStrings(Blake2b& blake, GeneratedString* output, BucketIndices* buckets);
   template<u32 batch_size>
-  void GenerateXStringsBatch(SpaceAllocator::Space* target_space, BucketIndices* buckets);
-  void GenerateXStringsTest(SpaceAllocator::Space* target_space, BucketIndices* buckets);
-
+  void GenerateXStringsBatch(Blake2b& blake, GeneratedString* output, BucketIndices* buckets);
+  void GenerateXStringsTest(GeneratedString* output, BucketIndices* buckets);
+  // Runs the reduction steps on strings `generated` into `buckets[0]` of
+  // the workspace.
+  i32 Reduce(Space* generated);
+
+  Workspace* GetWorkspace();
+  void ApplyMemoryPlan(u32 stage);
   void ClearSolutions() {
     valid_solutions_ = 0;
     invalid_solutions_ = 0;
+    stopped_.store(false, std::memory_order_relaxed);
     solutions_.clear();
   }
+  // Checked between reduction steps, see `SetStopCallback`.
+  bool StopRequested() {
+    if (stop_callback_ && stop_callback_())
+      stopped_.store(true, std::memory_order_relaxed);
+    return IsStopped();
+  }
   void ProcessSolutionCandidate(PairLink l8_link1, u32 link1_position,
                                 PairLink l8_link2, u32 link2_position);
+  void ProcessSolutionCandidate(SolutionCandidate& candidate);
+  void PushSolutionCandidate(const SolutionCandidate& candidate);
+  void ProcessSolutionCandidatesLoop();
   void ValidatePartialSolution(u32 level,
                                PairLink link1, u32 link1_position,
                                PairLink link2, u32 link2_position);
@@ -468,7 +800,9 @@ class Solver {
   void ReportStep(const char* name, bool major = false);
 
   Blake2b blake;
-  Context* context_;
+  SolutionVerifier verifier_;
+  // Lives in the fixed area of `allocator_`, created on the first run.
+  Workspace* workspace_ = nullptr;
   std::vector<Space*> link_indices_;
   Space* space_X1 = nullptr;
   Space* space_X2 = nullptr;
@@ -476,6 +810,7 @@ class Solver {
   u64 timer_start_ = 0;
   u64 major_start_ = 0;
   u64 last_report_ = 0;
+  RunStats stats_;
   SpaceAllocator allocator_;
   bool print_reports_ = true;
   u32 valid_solutions_ = 0;
@@ -484,6 +819,40 @@ class Solver {
   std::vector<const std::vector<u32>*> solutions_;
   std::vector<u32> temporary_solution_;
   bool initialized_ = false;
+  // Step8 output consumed by a companion thread, see
+  // `kProcessSolutionCandidatesInThread`, allocated only when it is set.
+  std::unique_ptr<SPSCRing<SolutionCandidate, Const::kSolutionCandidateRingSize>>
+      candidate_ring_;
+  std::atomic<bool> candidates_done_{false};
+  // The step8 thread (the caller) and the companion thread, which is
+  // started once and kept for all runs.
+  std::unique_ptr<ThreadTeam> candidate_team_;
+  SolutionCallback solution_callback_;
+  PhaseCallback phase_callback_;
+  StopCallback stop_callback_;
+  // See `SetSolutionOutput`.
+  u8* solution_output_ = nullptr;
+  u32 solution_output_capacity_ = 0;
+  bool solution_output_wrap_ = false;
+  std::atomic<u64> solution_output_count_{0};
+  // One per thread of a reduction step, empty when steps run in one thread.
+  std::vector<std::unique_ptr<StepWorker>> step_workers_;
+  // Threads running the reduction steps with the calling one.
+  std::unique_ptr<ThreadTeam> step_team_;
+
+  // Strings generated ahead by `PrepareNext`, they have own allocator, so
+  // that the generating thread doesn't touch `allocator_`.
+  struct Prepared : AlignedNew {
+    alignas(32) Inputs inputs;
+    Blake2b blake;
+    BucketIndices buckets;
+    SpaceAllocator allocator{Const::kMaximumStringSetSize, sizeof(GeneratedString), false};
+    Space* space = nullptr;
+    StepStats stats;
+    bool ready = false;
+  };
+  std::unique_ptr<Prepared> prepared_;
+  std::atomic<bool> stopped_{false};
 
   template<typename Configuration, typename SolverT>
   friend class ReductionStep;
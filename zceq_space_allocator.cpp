@@ -3,54 +3,291 @@
 #ifndef __WINDOWS__
 #include <sys/mman.h>
 #endif
+#include <algorithm>
+#include "zceq_numa.h"
 #include "zceq_space_allocator.h"
 
 namespace zceq_solver {
 
+// Huge page size the slabs are aligned to.
+static constexpr u64 kHugePageSize = 2ul << 20;
+static constexpr u64 kGiantPageSize = 1ul << 30;
+static constexpr u64 kPlainPageSize = 4096;
+
+#ifndef __WINDOWS__
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#endif
+
+const char* GetPagePolicyName(PagePolicy policy) {
+  switch (policy) {
+    case PagePolicy::kHugeTlb1G: return "hugetlb 1GB";
+    case PagePolicy::kHugeTlb2M: return "hugetlb 2MB";
+    case PagePolicy::kTransparentHuge: return "transparent huge pages";
+    case PagePolicy::kPlain: return "plain 4kB";
+  }
+  return "unknown";
+}
+
+static u64 RoundUp(u64 value, u64 alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+#ifndef __WINDOWS__
+// Maps memory of one page kind, returns nullptr on failure.
+static u8* TryMapMemory(MappedMemory& mapped, u64 size, PagePolicy policy) {
+  int protection = PROT_READ | PROT_WRITE;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  switch (policy) {
+    case PagePolicy::kHugeTlb1G:
+      mapped.size = RoundUp(size, kGiantPageSize);
+      mapped.page_size = kGiantPageSize;
+      flags |= MAP_HUGETLB | MAP_HUGE_1GB;
+      break;
+    case PagePolicy::kHugeTlb2M:
+      mapped.size = RoundUp(size, kHugePageSize);
+      mapped.page_size = kHugePageSize;
+      flags |= MAP_HUGETLB;
+      break;
+    case PagePolicy::kTransparentHuge: {
+      // Huge pages can be used only for 2MB aligned ranges, so the range
+      // is mapped larger and trimmed.
+      mapped.size = RoundUp(size, kHugePageSize);
+      auto result = mmap(nullptr, mapped.size + kHugePageSize, protection, flags, -1, 0);
+      if (result == MAP_FAILED)
+        return nullptr;
+      auto address = (u8*)result;
+      auto aligned = (u8*)RoundUp((u64)address, kHugePageSize);
+      if (aligned > address)
+        munmap(address, aligned - address);
+      if (aligned < address + kHugePageSize)
+        munmap(aligned + mapped.size, address + kHugePageSize - aligned);
+      bool advised = madvise(aligned, mapped.size, MADV_HUGEPAGE) == 0;
+      mapped.page_size = advised ? kHugePageSize : kPlainPageSize;
+      return aligned;
+    }
+    case PagePolicy::kPlain:
+      mapped.size = RoundUp(size, kPlainPageSize);
+      mapped.page_size = kPlainPageSize;
+      break;
+  }
+  auto result = mmap(nullptr, mapped.size, protection, flags, -1, 0);
+  if (result == MAP_FAILED)
+    return nullptr;
+  return (u8*)result;
+}
+#endif
+
+MappedMemory MapMemory(u64 size, PagePolicy policy) {
+  MappedMemory mapped;
+#ifdef __WINDOWS__
+  mapped.memory = (u8*)malloc(size);
+  mapped.size = size;
+  mapped.page_size = kPlainPageSize;
+  mapped.policy = PagePolicy::kPlain;
+#else
+  // Try the requested page kind and then the smaller ones.
+  for (auto kind = (int)policy; kind <= (int)PagePolicy::kPlain; ++kind) {
+    mapped.policy = (PagePolicy)kind;
+    mapped.memory = TryMapMemory(mapped, size, mapped.policy);
+    if (mapped.memory != nullptr)
+      break;
+  }
+  if (mapped.memory == nullptr) {
+    fprintf(stderr, "error number: %d\n", errno);
+    abort();
+  }
+  // Report only the first fallback, it would be the same for all solvers.
+  static std::atomic<bool> fallback_reported(false);
+  if (mapped.policy != policy && !fallback_reported.exchange(true)) {
+    fprintf(stderr, "[zceq_solver] Warning: %s pages not available, using %s.\n",
+            GetPagePolicyName(policy), GetPagePolicyName(mapped.policy));
+  }
+#endif
+  return mapped;
+}
+
+void UnmapMemory(MappedMemory& mapped) {
+  if (mapped.memory == nullptr)
+    return;
+#ifdef __WINDOWS__
+  free(mapped.memory);
+#else
+  munmap(mapped.memory, mapped.size);
+#endif
+  mapped.memory = nullptr;
+}
+
+SharedArena& SharedArena::Get() {
+  static SharedArena arena;
+  return arena;
+}
+
+bool SharedArena::Reserve(u64 slab_size, u32 slab_count, bool prefault) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (memory_ != nullptr || slab_count == 0)
+    return false;
+  slab_size_ = RoundUp(slab_size, kHugePageSize);
+  prefault_ = prefault;
+  slabs_.resize(slab_count);
+  mapping_ = MapMemory(slab_size_ * slab_count, RunTimeConfig.kPagePolicy);
+  memory_ = mapping_.memory;
+  return true;
+}
+
+u8* SharedArena::Acquire(u64 size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (memory_ == nullptr || size > slab_size_)
+    return nullptr;
+
+  // Prefer a slab already placed on our node, then a not touched one
+  // and only then any free slab (it has to be moved).
+  auto node = GetCurrentNumaNode();
+  u32 selected = SpaceAllocator::PlaceNotFound;
+  u32 selected_rank = 0;
+  for (auto i : range((u32)slabs_.size())) {
+    if (slabs_[i].used)
+      continue;
+    u32 rank = (slabs_[i].node == node) ? 3 : (slabs_[i].node == -1) ? 2 : 1;
+    if (rank > selected_rank) {
+      selected = i;
+      selected_rank = rank;
+    }
+  }
+  if (selected == SpaceAllocator::PlaceNotFound)
+    return nullptr;
+
+  slabs_[selected].used = true;
+  if (slabs_[selected].node != node)
+    PlaceSlab(selected, node);
+  return memory_ + selected * slab_size_;
+}
+
+void SharedArena::PlaceSlab(u32 slab, i32 node) {
+  auto address = memory_ + slab * slab_size_;
+  // Failure is not fatal (e.g. no NUMA support in kernel), the pages are
+  // then placed by the default policy.
+  BindMemoryToNode(address, slab_size_, node, true);
+  if (prefault_ && slabs_[slab].node == -1) {
+    for (u64 offset = 0; offset < slab_size_; offset += SpaceAllocator::granularity)
+      address[offset] = 0;
+  }
+  slabs_[slab].node = node;
+}
+
+void SharedArena::Release(u8* slab) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  assert(slab >= memory_ && slab < memory_ + slab_size_ * slabs_.size());
+  auto index = (u64)(slab - memory_) / slab_size_;
+  assert(slabs_[index].used);
+  slabs_[index].used = false;
+}
+
+u32 SharedArena::GetFreeSlabCount() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  u32 count = 0;
+  for (auto& slab : slabs_)
+    count += !slab.used;
+  return count;
+}
+
 SpaceAllocator::Space*
-SpaceAllocator::CreateSpace(std::string name, u32 place, u32 size) {
-  Space* space = nullptr;
-  if (space_objs_buffer_.empty()) {
-    space = new Space(this, time_, (u32) place,
-                      (u32) size, nullptr, name);
-    this->all_spaces_.push_back(space);
-  } else {
-    space = space_objs_buffer_.back();
-    space_objs_buffer_.pop_back();
-    space->name_ = name;
-    space->owner_ = this;
-    space->allocation_time_ = 0;
-    space->release_time_ = 0;
-    space->place_ = (u32)place;
-    space->size_ = (u32)size;
-    space->memory_ = nullptr;
+SpaceAllocator::CreateSpace(const char* name, u32 place, u32 size) {
+  if (space_count_ >= kMaxSpaces) {
+    fprintf(stderr, "[FATAL ERROR] SpaceAllocator: Too many spaces.\n");
+    abort();
   }
+  auto space = &spaces_[space_count_++];
+  space->name_ = name;
+  space->owner_ = this;
+  space->allocation_time_ = 0;
+  space->release_time_ = 0;
+  space->place_ = place;
+  space->size_ = size;
+  space->memory_ = nullptr;
   return space;
 }
 
-SpaceAllocator::Space*
-SpaceAllocator::Allocate(Space* space, u32 place, u32 size) {
+u32 SpaceAllocator::FindSlot(u32 slot, bool used) const {
+  while (slot < slot_count_) {
+    auto word = slot_mask_[slot / 64];
+    if (!used)
+      word = ~word;
+    word &= ~0ull << (slot % 64);
+    if (word != 0)
+      return std::min((u32)slot_count_, (slot & ~63u) + (u32)__builtin_ctzll(word));
+    slot = (slot & ~63u) + 64;
+  }
+  return (u32)slot_count_;
+}
+
+void SpaceAllocator::MarkSlots(u32 place, u32 size, bool used) {
+  for (auto slot = place; slot < place + size;) {
+    auto bits = std::min(64 - slot % 64, place + size - slot);
+    auto mask = ((bits == 64) ? ~0ull : ((1ull << bits) - 1)) << (slot % 64);
+    if (used)
+      slot_mask_[slot / 64] |= mask;
+    else
+      slot_mask_[slot / 64] &= ~mask;
+    slot += bits;
+  }
+}
+
+const SpaceAllocator::Space* SpaceAllocator::GetSlotOwner(u32 slot) const {
+  for (auto i : range(space_count_)) {
+    auto& space = spaces_[i];
+    if (space.memory_ != nullptr && slot >= space.place_ &&
+        slot < space.place_ + space.size_)
+      return &space;
+  }
+  return nullptr;
+}
+
+void SpaceAllocator::MapPool(const PoolOptions& options) {
+  auto size = GetPoolSize();
   if (memory_ == nullptr) {
-#ifdef __WINDOWS__
-    memory_ = (u8*)malloc(slot_count_ * slot_size_);
-#else
-    int protection = PROT_READ | PROT_WRITE;
-    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
-    flags |= MAP_HUGETLB;
-    auto size = slot_count_ * slot_size_;
-    auto result = mmap(nullptr, size, protection, flags, -1, 0);
-    if (result == MAP_FAILED) {
-      flags &= ~(MAP_HUGETLB);
-      result = mmap(nullptr, size, protection, flags, -1, 0);
-      if (result == MAP_FAILED) {
-        fprintf(stderr, "error number: %d\n", errno);
-        abort();
-      }
+    // Use a slab of the shared arena if there is one, map own memory
+    // otherwise.
+    memory_ = options.use_shared_arena ? SharedArena::Get().Acquire(size)
+                                       : nullptr;
+    shared_memory_ = (memory_ != nullptr);
+    if (shared_memory_) {
+      page_size_ = SharedArena::Get().GetPageSize();
+      page_policy_ = SharedArena::Get().GetPagePolicy();
+    } else {
+      mapping_ = MapMemory(size, RunTimeConfig.kPagePolicy);
+      memory_ = mapping_.memory;
+      page_size_ = mapping_.page_size;
+      page_policy_ = mapping_.policy;
     }
-    memory_ = (u8*)result;
-#endif
   }
 
+  if (options.prefault || options.lock) {
+    // Touch every (small) page, huge pages may not be granted for all
+    // the memory.
+    for (u64 offset = 0; offset < size; offset += granularity)
+      memory_[offset] = 0;
+  }
+#ifndef __WINDOWS__
+  if (options.lock && !locked_) {
+    locked_ = (mlock(memory_, size) == 0);
+    // Usually RLIMIT_MEMLOCK is too low, it is not fatal.
+    static std::atomic<bool> failure_reported(false);
+    if (!locked_ && !failure_reported.exchange(true))
+      fprintf(stderr, "[zceq_solver] Warning: memory pool can't be locked (error %d).\n", errno);
+  }
+#endif
+}
+
+SpaceAllocator::Space*
+SpaceAllocator::Allocate(Space* space, u32 place, u32 size) {
+  if (memory_ == nullptr)
+    MapPool(PoolOptions());
+
   if (space->IsUsed()) {
     assert(false);
     abort();
@@ -70,7 +307,8 @@ SpaceAllocator::Allocate(Space* space, u32 place, u32 size) {
   }
 
   time_++;
-  void* address = memory_ + place * slot_size_;
+  auto color = (u32)(space - spaces_) % color_count_;
+  void* address = memory_ + place * slot_size_ + color * color_step_;
   // void* address = address = (new u8[slot_size_ * space->size_ + 2 * 10000000]) + 10000000;
   // void* address = address = (new u8[slot_size_ * space->size_]);
 
@@ -79,32 +317,30 @@ SpaceAllocator::Allocate(Space* space, u32 place, u32 size) {
   space->allocation_time_ = time_;
   space->memory_ = address;
 
-  for (auto i : range(size)) {
-    auto slot = place + i;
-    if (slot_states_[slot] != nullptr) {
-      printf("Conflict at [%d]: '%s' and '%s', time %d\n", slot,
-             slot_states_[slot]->name_.c_str(), space->name_.c_str(), time_);
-      assert(false);
-      abort();
-    }
-    slot_states_[slot] = space;
+  auto conflict = FindSlot(place, true);
+  if (conflict < place + size) {
+    auto owner = GetSlotOwner(conflict);
+    printf("Conflict at [%d]: '%s' and '%s', time %d\n", conflict,
+           owner ? owner->name_ : "?", space->name_, time_);
+    assert(false);
+    abort();
   }
+  MarkSlots(place, size, true);
+  used_slots_ += size;
+  peak_used_slots_ = std::max(peak_used_slots_, used_slots_);
   if (dump_on_change_)
-    DumpState(space->name_.c_str());
+    DumpState(space->name_);
 
   return space;
 }
 
 u32 SpaceAllocator::FindFirstAvailable(u32 size) {
-  u32 count = 0;
-  for (auto i : range(slot_count_)) {
-    if (slot_states_[i] != nullptr)
-      count = 0;
-    else {
-      ++count;
-      if (count >= size)
-        return (u32)(i + 1 - size);
-    }
+  u32 free = FindSlot(0, false);
+  while (free + size <= slot_count_) {
+    auto used = FindSlot(free, true);
+    if (used - free >= size)
+      return free;
+    free = FindSlot(used, false);
   }
   return PlaceNotFound;
 }
@@ -116,17 +352,16 @@ SpaceAllocator::Space* SpaceAllocator::Release(Space* space, bool reallocation)
   if (!reallocation)
     time_++;
 
-  for (auto i : range(space->size_)) {
-    auto slot = space->place_ + i;
-    if (slot_states_[slot] != space) {
-      printf("Overwritten slot at [%d] for '%s', time %d\n", slot,
-             space->name_.c_str(), time_);
-      assert(false);
-    }
-    slot_states_[slot] = nullptr;
+  auto overwritten = FindSlot(space->place_, false);
+  if (overwritten < space->place_ + space->size_) {
+    printf("Overwritten slot at [%d] for '%s', time %d\n", overwritten,
+           space->name_, time_);
+    assert(false);
   }
+  MarkSlots(space->place_, space->size_, false);
+  used_slots_ -= space->size_;
   if (!reallocation && dump_on_change_)
-    DumpState(space->name_.c_str());
+    DumpState(space->name_);
 
   // delete[] ((u8*)(space->memory_) - 0);
   space->memory_ = nullptr;
@@ -135,15 +370,12 @@ SpaceAllocator::Space* SpaceAllocator::Release(Space* space, bool reallocation)
 }
 
 void SpaceAllocator::Reset() {
-  for (auto space : space_objs_buffer_) {
-    if (space->IsUsed())
-      space->Release();
-  }
-  space_objs_buffer_.clear();
-  std::copy(all_spaces_.begin(), all_spaces_.end(),
-            std::back_inserter(space_objs_buffer_));
-  for (auto& slot : slot_states_)
-    slot = nullptr;
+  for (auto i : range(space_count_))
+    spaces_[i].memory_ = nullptr;
+  space_count_ = 0;
+  for (auto& word : slot_mask_)
+    word = 0;
+  used_slots_ = 0;
 }
 
 template<typename Iter, typename Callable, typename Comparator=std::equal_to<Iter>>
@@ -162,8 +394,8 @@ void for_same(Iter begin, Iter end, Callable call, Comparator equal_to) {
 }
 
 template<typename Callable>
-void for_same_space(SpaceAllocator::Space*const* begin,
-                    SpaceAllocator::Space*const* end, Callable call) {
+void for_same_space(const SpaceAllocator::Space*const* begin,
+                    const SpaceAllocator::Space*const* end, Callable call) {
   if (begin == end)
     return;
   auto partition_begin = begin;
@@ -178,9 +410,13 @@ void for_same_space(SpaceAllocator::Space*const* begin,
 }
 
 void SpaceAllocator::DumpState(const char* message) const {
-  for_same_space(&slot_states_[0],
-                 &slot_states_[slot_states_.size()],
-           [](SpaceAllocator::Space*const*  beg, SpaceAllocator::Space*const*  end) {
+  // Only for debugging, so the slot owners can be collected slowly.
+  vector<const Space*> slot_states(slot_count_);
+  for (auto slot : range(slot_count_))
+    slot_states[slot] = GetSlotOwner((u32)slot);
+  for_same_space(&slot_states[0],
+                 &slot_states[slot_states.size()],
+           [](const SpaceAllocator::Space*const*  beg, const SpaceAllocator::Space*const*  end) {
              // int a = beg;
              auto space = *beg;
              if (!space) {
@@ -194,7 +430,7 @@ void SpaceAllocator::DumpState(const char* message) const {
                else if (space->size_ == 2)
                  printf("[]");
                else {
-                 auto used = std::min((u32)space->name_.size(), space->size_ - 2);
+                 auto used = std::min((u32)strlen(space->name_), space->size_ - 2);
                  auto left_ws = (space->size_ - used - 2) / 2;
                  auto right_ws = space->size_ - used - 2 - left_ws;
                  printf("[");
@@ -202,7 +438,7 @@ void SpaceAllocator::DumpState(const char* message) const {
                    (void)i;
                    printf(".");
                  }
-                 printf("%.*s", used, space->name_.c_str());
+                 printf("%.*s", used, space->name_);
                  for (auto i : range(right_ws)) {
                    (void)i;
                    printf(".");
@@ -215,15 +451,15 @@ void SpaceAllocator::DumpState(const char* message) const {
 }
 
 SpaceAllocator::~SpaceAllocator() {
-  for (auto a : all_spaces_)
-    delete a;
-
   if (memory_) {
-#ifdef __WINDOWS__
-    free(memory_);
-#else
-    munmap(memory_, slot_count_ * slot_size_);
+#ifndef __WINDOWS__
+    if (locked_)
+      munlock(memory_, GetPoolSize());
 #endif
+    if (shared_memory_)
+      SharedArena::Get().Release(memory_);
+    else
+      UnmapMemory(mapping_);
     memory_ = nullptr;
   }
 }
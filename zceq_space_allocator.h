@@ -3,46 +3,178 @@
 #define SPACE_ALLOCATOR_H_
 
 #include <cassert>
+#include <mutex>
 #include <vector>
-#include <string>
+#include "zceq_config.h"
 #include "zceq_misc.h"
 
 namespace zceq_solver {
 
 using std::vector;
 
+// Memory mapped for a memory pool.
+struct MappedMemory {
+  u8* memory = nullptr;
+  // Size of the mapping (rounded up to the page size).
+  u64 size = 0;
+  // Effective size of pages backing the memory.
+  u64 page_size = 0;
+  // Effective page kind (it can differ from the requested one).
+  PagePolicy policy = PagePolicy::kPlain;
+};
+
+// Maps memory of at least `size` bytes. If pages of the kind `policy`
+// are not available, smaller pages are used.
+MappedMemory MapMemory(u64 size, PagePolicy policy);
+void UnmapMemory(MappedMemory& mapped);
+
+// How a memory pool is prepared before the first use.
+struct PoolOptions {
+  // Fault all pages in, so that the first solving doesn't pay for it.
+  bool prefault = false;
+  // Lock the pages in RAM (mlock), it implies prefaulting.
+  bool lock = false;
+  // Take a slab of the shared arena when it is reserved. Small auxiliary
+  // pools must not, a slab would be wasted on them.
+  bool use_shared_arena = true;
+};
+
+// Process-wide pool of memory slabs for space allocators. The whole pool
+// is reserved by one mapping (with huge pages if possible) so that
+// creating and destroying solvers doesn't map and unmap memory again and
+// again. A slab is placed on the NUMA node of the thread which first
+// acquires it.
+class SharedArena {
+ public:
+  static SharedArena& Get();
+
+  // Reserves memory for `slab_count` slabs of `slab_size` bytes. It can be
+  // done only once per process. When `prefault` is set, pages of a slab
+  // are touched when the slab is acquired for the first time.
+  bool Reserve(u64 slab_size, u32 slab_count, bool prefault);
+  bool IsReserved() {
+    return memory_ != nullptr;
+  }
+  // Returns a free slab with at least `size` bytes or nullptr if there is
+  // no such slab.
+  u8* Acquire(u64 size);
+  void Release(u8* slab);
+  u32 GetFreeSlabCount();
+  u64 GetPageSize() {
+    return mapping_.page_size;
+  }
+  PagePolicy GetPagePolicy() {
+    return mapping_.policy;
+  }
+
+ protected:
+  SharedArena() = default;
+  SharedArena(const SharedArena&) = delete;
+  void PlaceSlab(u32 slab, i32 node);
+
+  struct Slab {
+    bool used = false;
+    // NUMA node where the slab pages are, -1 when not touched yet.
+    i32 node = -1;
+  };
+
+  std::mutex mutex_;
+  MappedMemory mapping_;
+  u8* memory_ = nullptr;
+  u64 slab_size_ = 0;
+  bool prefault_ = false;
+  vector<Slab> slabs_;
+};
+
 class SpaceAllocator {
  public:
   static constexpr u64 granularity = 4096;
   static_assert((granularity & (granularity - 1)) == 0ul, "");
 
-  SpaceAllocator(u64 slot_size, u64 needed_slots, bool report_changes) {
-    slot_size_ = (slot_size + granularity - 1) & ~(granularity - 1);
+  // Besides the slots, the pool can hold a fixed area of `fixed_size`
+  // bytes (behind the slots) for small data structures living for the
+  // whole time. With `color_count` > 1, the n-th created space starts
+  // (n % `color_count`) * `color_step` bytes after its first slot
+  // (cache coloring), slots are enlarged accordingly.
+  SpaceAllocator(u64 slot_size, u64 needed_slots, bool report_changes,
+                 u64 fixed_size = 0, u64 color_step = 0, u32 color_count = 1) {
+    slot_size_ = GetSlotSize(slot_size, color_step, color_count);
+    color_step_ = color_step;
+    color_count_ = color_count;
     slot_count_ = needed_slots;
-    slot_states_.resize(slot_count_);
+    fixed_size_ = (fixed_size + granularity - 1) & ~(granularity - 1);
+    slot_mask_.resize((slot_count_ + 63) / 64);
     dump_on_change_ = report_changes;
   }
   ~SpaceAllocator();
 
+  // Effective size of one slot (alignment and coloring included).
+  static u64 GetSlotSize(u64 slot_size, u64 color_step = 0,
+                         u32 color_count = 1) {
+    slot_size += color_step * (color_count - 1);
+    return (slot_size + granularity - 1) & ~(granularity - 1);
+  }
+  // Size of the memory pool needed by an allocator with given parameters.
+  static u64 GetPoolSize(u64 slot_size, u64 needed_slots, u64 fixed_size = 0,
+                         u64 color_step = 0, u32 color_count = 1) {
+    return GetSlotSize(slot_size, color_step, color_count) * needed_slots
+        + ((fixed_size + granularity - 1) & ~(granularity - 1));
+  }
+  u64 GetPoolSize() const {
+    return slot_count_ * slot_size_ + fixed_size_;
+  }
+  // Maximal memory used so far: the most slots allocated at one moment
+  // and the fixed area.
+  u64 GetPeakFootprint() const {
+    return peak_used_slots_ * slot_size_ + fixed_size_;
+  }
+
+  // Returns the fixed area, the pool is mapped if it is not yet.
+  u8* GetFixedArea() {
+    if (memory_ == nullptr)
+      MapPool(PoolOptions());
+    return memory_ + slot_count_ * slot_size_;
+  }
+
+  // Maps the memory pool now instead of on the first allocation. It can
+  // be called on an already mapped pool to prefault or lock it.
+  void MapPool(const PoolOptions& options);
+
+  // Effective size of memory pages of the pool, 0 until the pool is
+  // mapped (the first allocation).
+  u64 GetPageSize() {
+    return page_size_;
+  }
+  PagePolicy GetPagePolicy() {
+    return page_policy_;
+  }
+
   static constexpr u32 PlaceNotFound = 0xffffffff;
   static constexpr u32 FirstAvailable = 0xfffffffe;
+  // Maximum number of spaces created between two resets.
+  static constexpr u32 kMaxSpaces = 32;
 
   class Space {
-    Space(SpaceAllocator* owner, u32 time, u32 place, u32 size, void* memory, std::string name)
-        : place_(place), size_(size), memory_(memory), owner_(owner), allocation_time_(time),
-          release_time_(0), name_(name) {}
-    u32 place_;
-    u32 size_;
-    void* memory_;
-    SpaceAllocator* owner_;
-    u32 allocation_time_;
-    u32 release_time_;
-    std::string name_;
+    Space() = default;
+    u32 place_ = 0;
+    u32 size_ = 0;
+    void* memory_ = nullptr;
+    SpaceAllocator* owner_ = nullptr;
+    u32 allocation_time_ = 0;
+    u32 release_time_ = 0;
+    // Must have static storage duration (usually a literal).
+    const char* name_ = "";
 
    public:
     bool IsUsed() {
       return memory_ != nullptr;
     }
+    u32 GetPlace() {
+      return place_;
+    }
+    u32 GetSize() {
+      return size_;
+    }
     Space* Release() {
       owner_->Release(this, false);
       memory_ = nullptr;
@@ -100,17 +232,19 @@ class SpaceAllocator {
     friend class SpaceAllocator;
   };
 
+  // Space objects are preallocated, they are valid until the next reset.
+  // The `name` is not copied.
   template<typename T>
-  Space* CreateSpace(std::string name, u32 place) {
+  Space* CreateSpace(const char* name, u32 place) {
     return CreateSpace(name, place, sizeof(T));
   }
-  Space* CreateSpace(std::string name, u32 place, u32 size);
+  Space* CreateSpace(const char* name, u32 place, u32 size);
 
   template<typename T>
-  Space* Allocate(std::string name, u32 place) {
+  Space* Allocate(const char* name, u32 place) {
     return Allocate(name, place, sizeof(T));
   }
-  Space* Allocate(std::string name, u32 place, u32 size) {
+  Space* Allocate(const char* name, u32 place, u32 size) {
     auto space = CreateSpace(name, place, size);
     return Allocate(space, place, size);
   }
@@ -130,13 +264,34 @@ class SpaceAllocator {
  protected:
   Space* Allocate(Space* space, u32 place, u32 size);
   u32 FindFirstAvailable(u32 size);
+  // Bitset operations on `slot_mask_`.
+  bool IsSlotUsed(u32 slot) const {
+    return (slot_mask_[slot / 64] >> (slot % 64)) & 1;
+  }
+  // Returns the first used (`used` = true) or free slot from `slot`
+  // on, `slot_count_` if there is none.
+  u32 FindSlot(u32 slot, bool used) const;
+  void MarkSlots(u32 place, u32 size, bool used);
+  const Space* GetSlotOwner(u32 slot) const;
 
   u64 slot_size_;
+  u64 color_step_;
+  u32 color_count_;
   u64 slot_count_;
+  u64 fixed_size_;
+  u64 used_slots_ = 0;
+  u64 peak_used_slots_ = 0;
   u8* memory_ = nullptr;
-  vector<Space*> slot_states_;
-  vector<Space*> all_spaces_;
-  vector<Space*> space_objs_buffer_;
+  // The memory is a slab of `SharedArena`, not an own mapping.
+  bool shared_memory_ = false;
+  bool locked_ = false;
+  MappedMemory mapping_;
+  u64 page_size_ = 0;
+  PagePolicy page_policy_ = PagePolicy::kPlain;
+  // One bit per slot, set for used slots.
+  vector<u64> slot_mask_;
+  Space spaces_[kMaxSpaces];
+  u32 space_count_ = 0;
   u32 time_ = 0;
   bool dump_on_change_;
 };